@@ -21,11 +21,60 @@
 #include <optional>
 #include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
 #include <algorithm>
 #include <exception>
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <typeinfo>
+#include <type_traits>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <charconv>
+#include <limits>
+#include <cerrno>
+#include <sstream>
+
+#if !defined(BEHAVIOR_TREE_LITE_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define BEHAVIOR_TREE_LITE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define BEHAVIOR_TREE_LITE_X86_SIMD 0
+#endif
+
+// Define BEHAVIOR_TREE_LITE_PROFILER to 1 to keep the `node_path` that
+// `SamplingProfiler` samples. Otherwise ticks do not check for the profiler at all.
+#ifndef BEHAVIOR_TREE_LITE_PROFILER
+#define BEHAVIOR_TREE_LITE_PROFILER 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BEHAVIOR_TREE_LITE_POSIX 1
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <dlfcn.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#else
+#define BEHAVIOR_TREE_LITE_POSIX 0
+#endif
 
 namespace behavior_tree_lite {
 
@@ -35,8 +84,38 @@ enum class PortType {
     InOut,
 };
 
+/// A blackboard variable bound to a field of the user data of the `Context`.
+/// See `Registry::bind_field()`.
+struct FieldBinding {
+    const std::type_info* user_type;
+    const std::type_info* field_type;
+    /// Byte offset of the field in the user data
+    size_t offset;
+    /// Conversions for the string based `Context::get()` and `Context::set()`.
+    /// They are nullptr if the field type is not a number, a bool or a string.
+    std::string (*to_string)(const void* field);
+    void (*from_string)(void* field, const std::string& value);
+    /// Copies the field for the writes of a shadow tree, see `Context::shadow`.
+    /// nullptr if the field type cannot be copied.
+    std::shared_ptr<void> (*copy)(const void* field);
+};
+
+/// A port mapped to a variable bound to a field.
+struct FieldPort {
+    FieldBinding binding;
+    PortType ty;
+};
+
+/// An output port mapped to a variable that nothing reads, whose writes are dropped.
+/// See `find_dead_stores()`.
+struct DiscardedPort {
+    std::string variable;
+};
+
 /// The first variant is a variable reference. The second is a literal.
-using BlackboardValue = std::variant<std::pair<std::string, PortType>, std::string>;
+/// The third is a variable bound to a field of the user data.
+/// The fourth is an output to a variable that nothing reads.
+using BlackboardValue = std::variant<std::pair<std::string, PortType>, std::string, FieldPort, DiscardedPort>;
 
 struct PortMap {
     PortType ty;
@@ -55,6 +134,10 @@ struct TreeDef {
     PortMaps port_maps;
     std::vector<TreeDef> children;
     std::vector<VarDef> vars;
+    /// Byte offset of the node from the beginning of the source text.
+    /// The parser functions record it as the distance to the end of their input,
+    /// which `source_text()` and `StreamParser` convert with `rebase_offsets()`.
+    size_t offset = 0;
 };
 
 struct PortDef {
@@ -69,8 +152,10 @@ struct TreeRootDef {
 };
 
 struct VarDef {
-    std::string_view name;
-    std::optional<std::string_view> init;
+    std::string name;
+    std::optional<std::string> init;
+    /// Byte offset of the declaration, like `TreeDef::offset`
+    size_t offset = 0;
 };
 
 struct VarAssign {
@@ -376,7 +461,7 @@ IResult<PortMaps> port_maps_parens(std::string_view i) {
     return std::make_pair(r4.first, port_maps);
 }
 
-inline TreeDef tree_def_with_ports(std::string_view name, std::string init) {
+inline TreeDef tree_def_with_ports(std::string_view name, std::string init, size_t offset) {
     PortMaps port_maps;
     port_maps.push_back(PortMap {
         .ty = PortType::Input,
@@ -394,10 +479,12 @@ inline TreeDef tree_def_with_ports(std::string_view name, std::string init) {
         .name = "SetBool",
         .port_maps = port_maps,
         .children = std::vector<TreeDef>{},
+        .vars = {},
+        .offset = offset,
     };
 }
 
-inline TreeDef tree_def_from_elems(std::string name, PortMaps port_maps, std::vector<TreeElem> elems) {
+inline TreeDef tree_def_from_elems(std::string name, PortMaps port_maps, std::vector<TreeElem> elems, size_t offset) {
     std::vector<TreeDef> children;
     std::vector<VarDef> vars;
     for (auto& tree_elem : elems) {
@@ -406,7 +493,7 @@ inline TreeDef tree_def_from_elems(std::string name, PortMaps port_maps, std::ve
         }
         else if (auto var_def = std::get_if<VarDef>(&tree_elem)) {
             if (var_def->init) {
-                children.push_back(tree_def_with_ports(var_def->name, std::string(*var_def->init)));
+                children.push_back(tree_def_with_ports(var_def->name, *var_def->init, var_def->offset));
             }
             vars.push_back(std::move(*var_def));
         }
@@ -416,6 +503,7 @@ inline TreeDef tree_def_from_elems(std::string name, PortMaps port_maps, std::ve
         .port_maps = std::move(port_maps),
         .children = std::move(children),
         .vars = std::move(vars),
+        .offset = offset,
     };
 }
 
@@ -426,6 +514,7 @@ inline IResult<TreeDef> parse_tree_node(std::string_view i) {
     }
     auto r = std::get<0>(res);
     auto name = std::string(r.second);
+    auto offset = r.second.size() + r.first.size();
 
     auto next = r.first;
     PortMaps port_maps;
@@ -439,10 +528,10 @@ inline IResult<TreeDef> parse_tree_node(std::string_view i) {
     TreeDef ret; 
     if (auto r3 = std::get_if<0>(&res2)) {
         next = r3->first;
-        ret = tree_def_from_elems(name, std::move(port_maps), r3->second);
+        ret = tree_def_from_elems(name, std::move(port_maps), r3->second, offset);
     }
     else {
-        ret = tree_def_from_elems(name, std::move(port_maps), {});
+        ret = tree_def_from_elems(name, std::move(port_maps), {}, offset);
     }
     return std::make_pair(next, ret);
 }
@@ -457,19 +546,21 @@ inline IResult<TreeElem> parse_condition_node(std::string_view i) {
     auto res4 = match_char<')'>(r3);
     if (auto e = std::get_if<1>(&res4)) return *e;
     auto [next, _] = std::get<0>(res4);
+    auto true_offset = space(next).first.size();
     auto res5 = tree_children_block(next);
     std::vector<TreeDef> children{condition};
     if (auto r5 = std::get_if<0>(&res5)) {
         next = r5->first;
-        auto true_br = tree_def_from_elems("Sequence", PortMaps{}, std::move(r5->second));
+        auto true_br = tree_def_from_elems("Sequence", PortMaps{}, std::move(r5->second), true_offset);
         children.push_back(std::move(true_br));
     }
     next = space(next).first;
     if (next.substr(0, 4) == "else") {
+        auto false_offset = space(next.substr(4)).first.size();
         auto res6 = tree_children_block(next.substr(4));
         if (auto e = std::get_if<1>(&res6)) return *e;
         auto r6 = std::get<0>(res6);
-        auto false_br = tree_def_from_elems("Sequence", PortMaps{}, std::move(r6.second));
+        auto false_br = tree_def_from_elems("Sequence", PortMaps{}, std::move(r6.second), false_offset);
         children.push_back(std::move(false_br));
         next = r6.first;
     }
@@ -481,6 +572,131 @@ inline IResult<TreeElem> parse_condition_node(std::string_view i) {
     });
 }
 
+/// A pattern of a decision table cell: a value, optionally negated with `!`,
+/// or `_` which matches anything. The value is returned prefixed with '=' or '!',
+/// or empty for `_`.
+inline IResult<std::string> decision_pattern(std::string_view i) {
+    i = space(i).first;
+    std::string prefix = "=";
+    if (!i.empty() && i[0] == '!') {
+        prefix = "!";
+        i = i.substr(1);
+    }
+    auto res = string_literal(i);
+    if (auto pair = std::get_if<0>(&res)) {
+        return std::make_pair(pair->first, prefix + std::string(pair->second));
+    }
+    i = space(i).first;
+    auto r = i;
+    while (!r.empty() && (isalnum(r[0]) || r[0] == '_' || r[0] == '.' || r[0] == '-')) {
+        r = r.substr(1);
+    }
+    auto value = i.substr(0, r.data() - i.data());
+    if (value.empty()) {
+        return std::string("Expected a pattern");
+    }
+    if (value == "_") {
+        if (prefix == "!") return std::string("Wildcard cannot be negated");
+        return std::make_pair(r, std::string());
+    }
+    return std::make_pair(r, prefix + std::string(value));
+}
+
+/// Parses a decision table after the `table` keyword:
+///
+/// ```
+/// table (has_target, low_hp, mode) {
+///     true, false, !"flee" => Attack
+///     _, true, _ => Sequence { Flee Heal }
+/// }
+/// ```
+///
+/// The table is represented as a "DecisionTable" node with the variables as
+/// ports `c0, c1, ...`, the non-wildcard cells as literal ports `r<row>_<column>`
+/// and the actions as children.
+inline IResult<TreeElem> decision_table(std::string_view i) {
+    auto res = match_char<'('>(i);
+    if (auto e = std::get_if<1>(&res)) return *e;
+    auto next = std::get<0>(res).first;
+
+    PortMaps port_maps;
+    size_t columns = 0;
+    while (true) {
+        auto res2 = identifier(next);
+        if (auto e = std::get_if<1>(&res2)) return *e;
+        auto [r2, name] = std::get<0>(res2);
+        port_maps.push_back(PortMap {
+            .ty = PortType::Input,
+            .blackboard_literal = false,
+            .node_port = "c" + std::to_string(columns++),
+            .value = std::string(name),
+        });
+        auto res3 = match_char<','>(r2);
+        if (auto pair = std::get_if<0>(&res3)) {
+            next = pair->first;
+            continue;
+        }
+        auto res4 = match_char<')'>(r2);
+        if (auto e = std::get_if<1>(&res4)) return *e;
+        next = std::get<0>(res4).first;
+        break;
+    }
+
+    auto res5 = match_char<'{'>(next);
+    if (auto e = std::get_if<1>(&res5)) return *e;
+    next = std::get<0>(res5).first;
+
+    std::vector<TreeDef> actions;
+    while (true) {
+        auto end = match_char<'}'>(next);
+        if (auto pair = std::get_if<0>(&end)) {
+            next = pair->first;
+            break;
+        }
+        auto row = actions.size();
+        for (size_t column = 0; column < columns; column++) {
+            if (column != 0) {
+                auto res6 = match_char<','>(next);
+                if (auto e = std::get_if<1>(&res6)) {
+                    return "Decision table row " + std::to_string(row) + " has "
+                        + std::to_string(column) + " patterns, expected " + std::to_string(columns);
+                }
+                next = std::get<0>(res6).first;
+            }
+            auto res7 = decision_pattern(next);
+            if (auto e = std::get_if<1>(&res7)) return *e;
+            auto& [r7, pattern] = std::get<0>(res7);
+            next = r7;
+            if (!pattern.empty()) {
+                port_maps.push_back(PortMap {
+                    .ty = PortType::Input,
+                    .blackboard_literal = true,
+                    .node_port = "r" + std::to_string(row) + "_" + std::to_string(column),
+                    .value = std::move(pattern),
+                });
+            }
+        }
+        next = space(next).first;
+        if (next.substr(0, 2) != "=>") {
+            return std::string("Expected \"=>\" after the patterns of decision table row ") + std::to_string(row);
+        }
+        auto res8 = parse_tree_child(next.substr(2));
+        if (auto e = std::get_if<1>(&res8)) return *e;
+        auto& [r8, action] = std::get<0>(res8);
+        auto tree_def = std::get_if<TreeDef>(&action);
+        if (!tree_def) return std::string("Expected an action in decision table row ") + std::to_string(row);
+        actions.push_back(std::move(*tree_def));
+        next = r8;
+    }
+
+    return std::make_pair(next, TreeDef {
+        .name = "DecisionTable",
+        .port_maps = std::move(port_maps),
+        .children = std::move(actions),
+        .vars = std::vector<VarDef>{},
+    });
+}
+
 inline IResult<TreeElem> parse_tree_child(std::string_view i) {
     auto res = identifier(i);
     if (auto e = std::get_if<1>(&res)) return *e;
@@ -490,11 +706,30 @@ inline IResult<TreeElem> parse_tree_child(std::string_view i) {
         auto res = parse_condition_node(r.first);
         if (auto e = std::get_if<1>(&res)) return *e;
         auto r2 = std::get<0>(res);
+        if (auto tree_def = std::get_if<TreeDef>(&r2.second)) {
+            tree_def->offset = r.second.size() + r.first.size();
+        }
         return std::make_pair(r2.first, TreeElem{r2.second});
     }
 
     if (r.second == "var") {
-        return var_decl(r.first);
+        auto res = var_decl(r.first);
+        if (auto r2 = std::get_if<0>(&res)) {
+            if (auto var_def = std::get_if<VarDef>(&r2->second)) {
+                var_def->offset = r.second.size() + r.first.size();
+            }
+        }
+        return res;
+    }
+
+    if (r.second == "table") {
+        auto res = decision_table(r.first);
+        if (auto e = std::get_if<1>(&res)) return *e;
+        auto r2 = std::get<0>(res);
+        if (auto tree_def = std::get_if<TreeDef>(&r2.second)) {
+            tree_def->offset = r.second.size() + r.first.size();
+        }
+        return std::make_pair(r2.first, TreeElem{r2.second});
     }
 
     auto res2 = parse_tree_node(i);
@@ -525,15 +760,97 @@ inline IResult<TreeElem> var_decl(std::string_view i) {
     }
 
     return std::make_pair(next, VarDef {
-        .name = name,
-        .init = init,
+        .name = std::string(name),
+        .init = init ? std::optional<std::string>(*init) : std::nullopt,
     });
 }
 
+/// A position in a source text, with 1-based line and column numbers.
+struct SourceLocation {
+    std::string file;
+    size_t line;
+    size_t column;
+};
+
+inline std::string to_string(const SourceLocation& loc) {
+    std::string ret;
+    if (!loc.file.empty()) {
+        ret.append(loc.file);
+        ret += ':';
+    }
+    ret += std::to_string(loc.line) + ':' + std::to_string(loc.column);
+    return ret;
+}
+
+inline std::ostream &operator<<(std::ostream& os, const SourceLocation& loc) {
+    return os << to_string(loc);
+}
+
+/// Maps byte offsets in a source text to lines and columns.
+/// It only keeps the offsets of the line starts, not the text itself,
+/// and the lookup is done only when a location is asked for.
+class SourceMap {
+    std::string file_name;
+    /// The line number of `line_starts[0]`
+    size_t first_line = 1;
+    std::vector<size_t> line_starts{0};
+    size_t length = 0;
+
+public:
+    explicit SourceMap(std::string file_name = "") : file_name(std::move(file_name)) {}
+
+    SourceMap(std::string file_name, std::string_view text) : file_name(std::move(file_name)) {
+        append(text);
+    }
+
+    /// Maps a part of a longer text that begins at `offset`, on the line `line`
+    /// beginning at `line_start`. The text is given by `append()`.
+    SourceMap(std::string file_name, size_t offset, size_t line, size_t line_start) :
+        file_name(std::move(file_name)), first_line(line), line_starts{line_start}, length(offset) {}
+
+    /// Appends a chunk of the source text, for sources that arrive incrementally.
+    void append(std::string_view text) {
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '\n') {
+                line_starts.push_back(length + i + 1);
+            }
+        }
+        length += text.size();
+    }
+
+    const std::string& file() const {
+        return file_name;
+    }
+
+    SourceLocation locate(size_t offset) const {
+        auto it = std::upper_bound(line_starts.begin(), line_starts.end(), offset);
+        auto index = static_cast<size_t>(it - line_starts.begin());
+        return SourceLocation {
+            .file = file_name,
+            .line = first_line + index - 1,
+            .column = offset - line_starts[index - 1] + 1,
+        };
+    }
+};
+
+/// Converts the offsets recorded by the parser functions, which count from the end
+/// of their input, to the offsets from the beginning of the source text of `length` bytes.
+inline void rebase_offsets(TreeDef& node, size_t length) {
+    node.offset = length - node.offset;
+    for (auto& var : node.vars) {
+        var.offset = length - var.offset;
+    }
+    for (auto& child : node.children) {
+        rebase_offsets(child, length);
+    }
+}
+
 struct Tree {
     std::string name;
     TreeDef node;
     std::vector<PortDef> ports;
+    /// The source text the tree was parsed from, which resolves `TreeDef::offset`
+    std::shared_ptr<const SourceMap> source_map;
 };
 
 inline std::ostream &operator<<(std::ostream& os, const Tree& tree) {
@@ -557,6 +874,212 @@ inline std::ostream &operator<<(std::ostream& os, const std::vector<Tree>& trees
     return os;
 }
 
+/// Writes JSON into a buffer that can be reused for many documents, without the
+/// overhead of iostreams. The caller is responsible for the nesting of the objects
+/// and arrays; commas are inserted automatically.
+class JsonWriter {
+    std::string buffer;
+    /// Whether the object or array at each level already has an element
+    std::vector<bool> nonempty;
+    bool after_key = false;
+
+    void separator() {
+        if (after_key) {
+            after_key = false;
+            return;
+        }
+        if (!nonempty.empty()) {
+            if (nonempty.back()) buffer += ',';
+            nonempty.back() = true;
+        }
+    }
+
+    void write_string(std::string_view s) {
+        static const char hex[] = "0123456789abcdef";
+        buffer += '"';
+        size_t run = 0;
+        for (size_t i = 0; i < s.size(); i++) {
+            auto c = static_cast<unsigned char>(s[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            buffer.append(s.data() + run, i - run);
+            run = i + 1;
+            switch (c) {
+                case '"': buffer += "\\\""; break;
+                case '\\': buffer += "\\\\"; break;
+                case '\n': buffer += "\\n"; break;
+                case '\t': buffer += "\\t"; break;
+                case '\r': buffer += "\\r"; break;
+                default:
+                    buffer += "\\u00";
+                    buffer += hex[c >> 4];
+                    buffer += hex[c & 0xf];
+            }
+        }
+        buffer.append(s.data() + run, s.size() - run);
+        buffer += '"';
+    }
+
+public:
+    /// Empties the buffer, keeping its memory.
+    void clear() {
+        buffer.clear();
+        nonempty.clear();
+        after_key = false;
+    }
+
+    const std::string& str() const {
+        return buffer;
+    }
+
+    JsonWriter& begin_object() {
+        separator();
+        buffer += '{';
+        nonempty.push_back(false);
+        return *this;
+    }
+
+    JsonWriter& end_object() {
+        buffer += '}';
+        nonempty.pop_back();
+        return *this;
+    }
+
+    JsonWriter& begin_array() {
+        separator();
+        buffer += '[';
+        nonempty.push_back(false);
+        return *this;
+    }
+
+    JsonWriter& end_array() {
+        buffer += ']';
+        nonempty.pop_back();
+        return *this;
+    }
+
+    JsonWriter& key(std::string_view name) {
+        separator();
+        write_string(name);
+        buffer += ':';
+        after_key = true;
+        return *this;
+    }
+
+    JsonWriter& value(std::string_view s) {
+        separator();
+        write_string(s);
+        return *this;
+    }
+
+    JsonWriter& value(const char* s) {
+        return value(std::string_view(s));
+    }
+
+    JsonWriter& value(bool b) {
+        separator();
+        buffer += b ? "true" : "false";
+        return *this;
+    }
+
+    /// Writes a number, or null if it is not finite, which JSON cannot represent.
+    JsonWriter& value(double d) {
+        if (!std::isfinite(d)) return null();
+        separator();
+        char buf[32];
+        auto res = std::to_chars(buf, buf + sizeof buf, d);
+        buffer.append(buf, res.ptr - buf);
+        return *this;
+    }
+
+    JsonWriter& value(uint64_t n) {
+        separator();
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof buf, n);
+        buffer.append(buf, res.ptr - buf);
+        return *this;
+    }
+
+    JsonWriter& null() {
+        separator();
+        buffer += "null";
+        return *this;
+    }
+};
+
+inline const char* to_string(PortType ty) {
+    switch (ty) {
+        case PortType::Input: return "in";
+        case PortType::Output: return "out";
+        default: return "inout";
+    }
+}
+
+/// Writes the node and its descendants as a JSON object. The line and the column
+/// of each node are included if the source map is given.
+inline void write_json(JsonWriter& json, const TreeDef& node, const SourceMap* source_map = nullptr) {
+    json.begin_object();
+    json.key("name").value(node.name);
+    if (source_map) {
+        auto loc = source_map->locate(node.offset);
+        json.key("line").value(uint64_t(loc.line));
+        json.key("column").value(uint64_t(loc.column));
+    }
+    json.key("ports").begin_array();
+    for (auto& port_map : node.port_maps) {
+        json.begin_object();
+        json.key("port").value(port_map.node_port);
+        json.key("direction").value(to_string(port_map.ty));
+        json.key(port_map.blackboard_literal ? "literal" : "variable").value(port_map.value);
+        json.end_object();
+    }
+    json.end_array();
+    if (!node.vars.empty()) {
+        json.key("vars").begin_array();
+        for (auto& var : node.vars) {
+            json.begin_object();
+            json.key("name").value(var.name);
+            json.key("init");
+            if (var.init) json.value(*var.init);
+            else json.null();
+            json.end_object();
+        }
+        json.end_array();
+    }
+    json.key("children").begin_array();
+    for (auto& child : node.children) {
+        write_json(json, child, source_map);
+    }
+    json.end_array();
+    json.end_object();
+}
+
+inline void write_json(JsonWriter& json, const Tree& tree) {
+    json.begin_object();
+    json.key("name").value(tree.name);
+    if (tree.source_map) {
+        json.key("file").value(tree.source_map->file());
+    }
+    json.key("ports").begin_array();
+    for (auto& port : tree.ports) {
+        json.begin_object();
+        json.key("name").value(port.name);
+        json.key("direction").value(to_string(port.direction));
+        json.end_object();
+    }
+    json.end_array();
+    json.key("root");
+    write_json(json, tree.node, tree.source_map.get());
+    json.end_object();
+}
+
+inline void write_json(JsonWriter& json, const std::vector<Tree>& trees) {
+    json.begin_array();
+    for (auto& tree : trees) {
+        write_json(json, tree);
+    }
+    json.end_array();
+}
+
 inline IResult<PortDef> port_def(std::string_view i) {
     i = space(i).first;
     auto first = identifier(i);
@@ -667,6 +1190,7 @@ IResult<Tree> parse_tree(std::string_view i) {
             .name = std::string(name_ok.second),
             .node = std::move(*t_def),
             .ports = port_defs,
+            .source_map = nullptr,
         });
     }
     else {
@@ -674,10 +1198,104 @@ IResult<Tree> parse_tree(std::string_view i) {
     }
 }
 
-using TreeSource = std::vector<Tree>;
+struct Registry;
+struct Program;
+
+using Blackboard = std::unordered_map<std::string, std::string>;
+
+/// A set of trees parsed from source texts.
+///
+/// It caches the index of tree names and the compiled programs of the entry trees,
+/// so that instantiating many agents of the same tree does not walk the `TreeDef`s
+/// again. The caches are locked, so that threads can load from the same source.
+/// Appending trees and changing the registry are detected, see `Registry::fingerprint()`,
+/// but if you modify the trees in place, call `clear_cache()`.
+struct TreeSource : std::vector<Tree> {
+    using std::vector<Tree>::vector;
+
+    /// Finds a tree by name, or returns nullptr.
+    const Tree* find(std::string_view name) const {
+        std::lock_guard lock(cache.mutex);
+        if (cache.indexed != size()) {
+            build_index_locked();
+        }
+        auto it = cache.index.find(std::string(name));
+        if (it == cache.index.end() || it->second >= size()) return nullptr;
+        return &(*this)[it->second];
+    }
+
+    /// Returns the program of the entry tree compiled against the registry,
+    /// compiling it on the first call. Returns nullptr if there is no such tree.
+    ///
+    /// A program specialized for `constants` is cached separately for each set of
+    /// values, so agents spawned with the same values share it. See `compile()`.
+    /// Once `Registry::max_specializations` sets are cached for the entry, other
+    /// values get the program without constants.
+    std::shared_ptr<const Program> program(
+        std::string_view entry,
+        const Registry& registry,
+        const Blackboard& constants = {}
+    ) const;
+
+    /// Builds the index of tree names. If there are trees with the same name,
+    /// the first one is found.
+    void build_index() const {
+        std::lock_guard lock(cache.mutex);
+        build_index_locked();
+    }
+
+    void clear_cache() const {
+        std::lock_guard lock(cache.mutex);
+        cache.index.clear();
+        cache.indexed = 0;
+        cache.programs.clear();
+        cache.specializations.clear();
+    }
+
+private:
+    struct CachedProgram {
+        uint64_t registry_id;
+        uint64_t registry_fingerprint;
+        std::shared_ptr<const Program> program;
+    };
+    /// The caches, which copies of the source do not share
+    struct Cache {
+        std::mutex mutex;
+        std::unordered_map<std::string, size_t> index;
+        /// The number of trees in the index, which can have fewer entries if names repeat
+        size_t indexed = 0;
+        std::unordered_map<std::string, CachedProgram> programs;
+        /// The number of specialized programs in `programs` for each entry
+        std::unordered_map<std::string, size_t> specializations;
+
+        Cache() = default;
+        Cache(const Cache&) {}
+        Cache& operator=(const Cache&) {
+            std::lock_guard lock(mutex);
+            index.clear();
+            indexed = 0;
+            programs.clear();
+            specializations.clear();
+            return *this;
+        }
+    };
+    mutable Cache cache;
+
+    void build_index_locked() const {
+        cache.index.clear();
+        for (size_t i = 0; i < size(); i++) {
+            cache.index.emplace((*this)[i].name, i);
+        }
+        cache.indexed = size();
+    }
+};
 
-IResult<TreeSource> source_text(std::string_view i) {
-    std::vector<Tree> ret;
+/// Parses a whole source text. `file_name` is only used to report the locations
+/// of the nodes.
+IResult<TreeSource> source_text(std::string_view i, std::string file_name = "") {
+    TreeSource ret;
+    auto source_map = std::make_shared<const SourceMap>(std::move(file_name), i);
+    auto length = i.size();
 
     while (!i.empty()) {
         auto res = parse_tree(i);
@@ -685,6 +1303,8 @@ IResult<TreeSource> source_text(std::string_view i) {
             return *e;
         }
         auto pair = std::get<0>(res);
+        rebase_offsets(pair.second.node, length);
+        pair.second.source_map = source_map;
         ret.push_back(pair.second);
         i = pair.first;
     }
@@ -692,570 +1312,6108 @@ IResult<TreeSource> source_text(std::string_view i) {
     return std::make_pair(i, ret);
 }
 
-enum class BehaviorResult {
-    Success,
-    Fail,
-    /// The node should keep running in the next tick
-    Running,
-};
+/// A push-style parser for source text that arrives in chunks, e.g. from a pipe.
+///
+/// Feed it chunks of any size with `feed()` and call `finish()` at the end of input.
+/// Each top-level tree is handed to the callback as soon as it is complete, which is
+/// usually when its closing brace arrives. A tree whose root is an `if` without
+/// `else` and a tree without a children block are only known to be complete when the
+/// next `tree` keyword or the end of input arrives.
+///
+/// Only the text of the unfinished tree is kept in the buffer, so the memory usage
+/// is bounded by the largest single tree rather than by the whole source.
+class StreamParser {
+    std::function<void(Tree)> on_tree;
+    std::string pending;
+    /// The number of bytes before `pending` in the whole stream
+    size_t consumed = 0;
+    std::string file_name;
+    /// The line of the stream at `consumed` and the offset where it begins. Each tree
+    /// gets a `SourceMap` of its own text that starts there, so that the maps do not
+    /// grow with the stream.
+    size_t line = 1;
+    size_t line_start = 0;
+    /// Position in `pending` where scanning resumes
+    size_t scan_pos = 0;
+    int brace_depth = 0;
+    int paren_depth = 0;
+    bool in_string = false;
+    std::optional<std::string> error;
+
+    static bool is_ident_char(char c) {
+        return isalnum(c) || c == '_';
+    }
 
-using BBMap = std::unordered_map<std::string, BlackboardValue>;
+    /// Parses and emits the first `len` bytes of the buffer as a tree.
+    /// If `at_brace` is true, a tree that may still be continued by an `else`
+    /// clause is left in the buffer.
+    bool emit(size_t len, bool at_brace = false) {
+        auto text = std::string_view(pending).substr(0, len);
+        if (empty_lines(text).first.empty()) {
+            return true;
+        }
+        auto res = parse_tree(text);
+        if (auto e = std::get_if<1>(&res)) {
+            error = *e;
+            return false;
+        }
+        auto& pair = std::get<0>(res);
+        if (!empty_lines(pair.first).first.empty()) {
+            error = std::string("Unexpected text after a tree: ") + std::string(pair.first);
+            return false;
+        }
+        if (at_brace && pair.second.node.name == "if" && pair.second.node.children.size() == 2) {
+            return true;
+        }
+        rebase_offsets(pair.second.node, consumed + len);
+        auto source_map = std::make_shared<SourceMap>(file_name, consumed, line, line_start);
+        source_map->append(text);
+        pair.second.source_map = std::move(source_map);
+        for (size_t i = 0; i < len; i++) {
+            if (text[i] == '\n') {
+                line++;
+                line_start = consumed + i + 1;
+            }
+        }
+        on_tree(std::move(pair.second));
+        pending.erase(0, len);
+        scan_pos -= len;
+        consumed += len;
+        return true;
+    }
 
-struct Context;
-struct BehaviorNodeContainer;
+    bool scan(bool last) {
+        while (scan_pos < pending.size()) {
+            char c = pending[scan_pos];
+            if (in_string) {
+                if (c == '"') in_string = false;
+                scan_pos++;
+                continue;
+            }
+            if (c == '"') {
+                in_string = true;
+                scan_pos++;
+            }
+            else if (c == '(') {
+                paren_depth++;
+                scan_pos++;
+            }
+            else if (c == ')') {
+                paren_depth--;
+                scan_pos++;
+            }
+            else if (c == '{') {
+                brace_depth++;
+                scan_pos++;
+            }
+            else if (c == '}') {
+                brace_depth--;
+                scan_pos++;
+                if (brace_depth == 0 && paren_depth == 0) {
+                    if (!emit(scan_pos, true)) return false;
+                }
+            }
+            else if (isalpha(c) || c == '_') {
+                auto end = scan_pos;
+                while (end < pending.size() && is_ident_char(pending[end])) end++;
+                if (end == pending.size() && !last) {
+                    // The identifier may continue in the next chunk
+                    return true;
+                }
+                if (brace_depth == 0 && paren_depth == 0
+                    && std::string_view(pending).substr(scan_pos, end - scan_pos) == "tree")
+                {
+                    if (!emit(scan_pos)) return false;
+                    end = scan_pos + 4;
+                }
+                scan_pos = end;
+            }
+            else {
+                scan_pos++;
+            }
+        }
+        return true;
+    }
 
-class BehaviorNode {
 public:
-    virtual BehaviorResult tick(Context& context) = 0;
-};
-
-struct Registry {
-    std::unordered_map<std::string, std::function<std::unique_ptr<BehaviorNode> ()>> node_types;
-    std::unordered_map<std::string, std::string> key_names;
-};
+    explicit StreamParser(std::function<void(Tree)> on_tree, std::string file_name = "") :
+        on_tree(std::move(on_tree)),
+        file_name(std::move(file_name)) {}
+
+    /// Appends a chunk of source text. Returns an error message if the source
+    /// is malformed. Once an error is returned, all subsequent calls return it too.
+    std::optional<std::string> feed(std::string_view chunk) {
+        if (error) return error;
+        pending.append(chunk);
+        scan(false);
+        return error;
+    }
 
-using Blackboard = std::unordered_map<std::string, std::string>;
+    /// Signals the end of input and emits the last tree, if any.
+    std::optional<std::string> finish() {
+        if (error) return error;
+        if (!scan(true)) return error;
+        if (in_string || brace_depth != 0 || paren_depth != 0) {
+            error = std::string("Unexpected end of input");
+            return error;
+        }
+        emit(pending.size());
+        return error;
+    }
 
-class undefined_port_error : public std::exception {
-    const char* what() const noexcept override {
-        return "Attempt to assign to an undefined port";
+    /// The number of bytes buffered for the unfinished tree.
+    size_t buffered() const {
+        return pending.size();
     }
 };
 
-class undefined_variable_error : public std::exception {
-    const char* what() const noexcept override {
-        return "Could not find the named variable";
+/// Parses trees from a stream, such as std::cin, handing each of them to `on_tree`
+/// as soon as it is complete.
+inline std::optional<std::string> parse_stream(
+    std::istream& is,
+    std::function<void(Tree)> on_tree,
+    std::string file_name = "",
+    size_t chunk_size = 4096
+) {
+    StreamParser parser(std::move(on_tree), std::move(file_name));
+    std::string chunk(chunk_size, '\0');
+    while (is) {
+        is.read(chunk.data(), chunk.size());
+        auto len = static_cast<size_t>(is.gcount());
+        if (len == 0) break;
+        if (auto e = parser.feed(std::string_view(chunk).substr(0, len))) {
+            return e;
+        }
     }
-};
+    return parser.finish();
+}
+
+/// A blocking FIFO queue with a fixed capacity, shared between producer and
+/// consumer threads. `push()` waits while the queue is full and `pop()` waits
+/// while it is empty.
+template<typename T>
+class BoundedQueue {
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
 
-class undefined_node_error : public std::exception {
-    std::string name;
 public:
-    undefined_node_error(std::string name) : name(std::move(name)) {}
-    const char* what() const noexcept override {
-        thread_local std::string ret;
-        ret = std::string("Could not find the node type name: ") + name;
-        return ret.c_str();
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(capacity, 1)) {}
+
+    /// Returns false if the queue is closed.
+    bool push(T item) {
+        std::unique_lock lock(mutex);
+        not_full.wait(lock, [this]{ return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
     }
-};
 
-class write_input_port_error : public std::exception {
-    const char* what() const noexcept override {
-        return "Attempt to assign to a input port";
+    /// Returns std::nullopt once the queue is closed and drained.
+    std::optional<T> pop() {
+        std::unique_lock lock(mutex);
+        not_empty.wait(lock, [this]{ return closed || !items.empty(); });
+        if (items.empty()) return std::nullopt;
+        auto ret = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return ret;
     }
-};
 
-class write_to_literal_error : public std::exception {
-    const char* what() const noexcept override {
-        return "Attempt to assign to a literal";
+    /// Wakes up all the waiting threads. Items already queued can still be popped.
+    void close() {
+        std::lock_guard lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
     }
 };
 
-class invalid_count_error : public std::exception {
-    const char* what() const noexcept override {
-        return "Invalid count string";
-    }
+struct DirectoryLoadOptions {
+    /// Only the files with this extension are loaded
+    std::string extension = ".bt";
+    bool recursive = true;
+    /// The number of threads reading files. Keep it small, since the reads are
+    /// bound by the disk rather than the CPU.
+    size_t io_threads = 2;
+    /// The number of threads parsing files, or 0 to use the hardware threads left
+    /// by the readers, at least one
+    size_t parse_threads = 0;
+    /// The number of files read but not parsed yet, which bounds the memory usage
+    size_t queue_capacity = 64;
 };
 
-struct Context {
-    Blackboard blackboard;
-    BBMap *blackboard_map;
-    std::vector<BehaviorNodeContainer>* child_nodes;
-//    bool strict;
+struct DirectoryLoadTimings {
+    /// Wall clock time to list the files
+    std::chrono::nanoseconds scan{};
+    /// Time spent reading files, summed over the I/O threads
+    std::chrono::nanoseconds read{};
+    /// Time spent parsing, summed over the parse threads
+    std::chrono::nanoseconds parse{};
+    /// Wall clock time to merge the trees into one source
+    std::chrono::nanoseconds merge{};
+    std::chrono::nanoseconds total{};
+    size_t files = 0;
+    size_t bytes = 0;
+    size_t trees = 0;
+};
 
-    std::optional<std::string> get(const std::string& port_name) const {
-        auto var_it = blackboard_map->find(port_name);
-        if (var_it != blackboard_map->end()) {
-            if (auto x = std::get_if<0>(&var_it->second)) {
-                if (x->second == PortType::Output) return std::nullopt;
-                auto y = blackboard.find(x->first);
-                if (y == blackboard.end()) return std::nullopt;
-                return y->second;
-            }
-            if (auto x = std::get_if<1>(&var_it->second)) {
-                return *x;
-            }
-        }
-        return std::nullopt;
-    }
+inline std::ostream &operator<<(std::ostream& os, const DirectoryLoadTimings& timings) {
+    auto ms = [](std::chrono::nanoseconds t) { return std::chrono::duration<double, std::milli>(t).count(); };
+    os << timings.files << " files, " << timings.bytes << " bytes, " << timings.trees << " trees: "
+        << "scan " << ms(timings.scan) << " ms, "
+        << "read " << ms(timings.read) << " ms, "
+        << "parse " << ms(timings.parse) << " ms, "
+        << "merge " << ms(timings.merge) << " ms, "
+        << "total " << ms(timings.total) << " ms";
+    return os;
+}
 
-    void set(const std::string& port_name, const std::string& value) {
-        auto var_it = blackboard_map->find(port_name);
-        if (var_it == blackboard_map->end()) {
-            throw undefined_port_error{};
+struct DirectoryLoadResult {
+    /// All the trees in the directory, in the order of the file paths
+    TreeSource source;
+    DirectoryLoadTimings timings;
+    /// Errors prefixed by the file path. A file with an error contributes no trees.
+    std::vector<std::string> errors;
+};
+
+/// Loads all the source files in a directory into one source.
+///
+/// The files are read by a small pool of I/O threads and handed over through a
+/// bounded queue to a pool of parser threads, so reading and parsing overlap.
+/// Tree names must be unique across files; the later duplicates are reported
+/// as errors and dropped.
+inline DirectoryLoadResult load_directory(
+    const std::filesystem::path& dir,
+    const DirectoryLoadOptions& options = {}
+) {
+    using clock = std::chrono::steady_clock;
+    namespace fs = std::filesystem;
+    auto start = clock::now();
+    DirectoryLoadResult ret;
+
+    std::vector<fs::path> paths;
+    std::error_code ec;
+    auto add_entry = [&](const fs::directory_entry& entry) {
+        if (entry.is_regular_file() && entry.path().extension() == options.extension) {
+            paths.push_back(entry.path());
         }
+    };
+    if (options.recursive) {
+        for (auto it = fs::recursive_directory_iterator(dir, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+            add_entry(*it);
+        }
+    }
+    else {
+        for (auto it = fs::directory_iterator(dir, ec); !ec && it != fs::directory_iterator(); it.increment(ec)) {
+            add_entry(*it);
+        }
+    }
+    if (ec) {
+        ret.errors.push_back(dir.string() + ": " + ec.message());
+    }
+    std::sort(paths.begin(), paths.end());
+    auto scanned = clock::now();
+    ret.timings.scan = scanned - start;
+    ret.timings.files = paths.size();
+
+    struct FileText {
+        size_t index;
+        std::string text;
+    };
+    struct FileResult {
+        TreeSource trees;
+        std::string error;
+    };
+    std::vector<FileResult> results(paths.size());
+    BoundedQueue<FileText> queue(options.queue_capacity);
+    std::atomic<size_t> next_file{0};
+    std::atomic<size_t> bytes{0};
+    std::atomic<int64_t> read_ns{0};
+    std::atomic<int64_t> parse_ns{0};
+
+    auto read_files = [&]() {
+        for (auto i = next_file++; i < paths.size(); i = next_file++) {
+            auto t0 = clock::now();
+            std::ifstream ifs(paths[i], std::ios::binary);
+            std::string text;
+            if (ifs) {
+                std::error_code size_ec;
+                auto size = fs::file_size(paths[i], size_ec);
+                if (!size_ec) text.reserve(size);
+                text.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+            }
+            else {
+                results[i].error = "Could not open the file";
+            }
+            bytes += text.size();
+            read_ns += (clock::now() - t0).count();
+            if (results[i].error.empty()) {
+                queue.push(FileText{ i, std::move(text) });
+            }
+        }
+    };
+
+    auto parse_files = [&]() {
+        while (auto file = queue.pop()) {
+            auto t0 = clock::now();
+            auto res = source_text(file->text, paths[file->index].string());
+            if (auto e = std::get_if<1>(&res)) {
+                results[file->index].error = *e;
+            }
+            else {
+                results[file->index].trees = std::move(std::get<0>(res).second);
+            }
+            parse_ns += (clock::now() - t0).count();
+        }
+    };
+
+    auto io_threads = std::max<size_t>(options.io_threads, 1);
+    size_t hardware_threads = std::thread::hardware_concurrency();
+    auto parse_threads = options.parse_threads ? options.parse_threads
+        : hardware_threads > io_threads ? hardware_threads - io_threads : 1;
+    std::vector<std::thread> readers;
+    std::vector<std::thread> parsers;
+    for (size_t i = 0; i < io_threads; i++) {
+        readers.emplace_back(read_files);
+    }
+    for (size_t i = 0; i < parse_threads; i++) {
+        parsers.emplace_back(parse_files);
+    }
+    for (auto& thread : readers) thread.join();
+    queue.close();
+    for (auto& thread : parsers) thread.join();
+
+    ret.timings.read = std::chrono::nanoseconds(read_ns.load());
+    ret.timings.parse = std::chrono::nanoseconds(parse_ns.load());
+    ret.timings.bytes = bytes;
+
+    auto merge_start = clock::now();
+    std::unordered_map<std::string, size_t> defined_in;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (!results[i].error.empty()) {
+            ret.errors.push_back(paths[i].string() + ": " + results[i].error);
+            continue;
+        }
+        for (auto& tree : results[i].trees) {
+            auto [it, inserted] = defined_in.emplace(tree.name, i);
+            if (!inserted) {
+                ret.errors.push_back(paths[i].string() + ": Duplicate tree name \"" + tree.name
+                    + "\", first defined in " + paths[it->second].string());
+                continue;
+            }
+            ret.source.push_back(std::move(tree));
+        }
+    }
+    ret.source.build_index();
+    auto end = clock::now();
+    ret.timings.merge = end - merge_start;
+    ret.timings.total = end - start;
+    ret.timings.trees = ret.source.size();
+
+    return ret;
+}
+
+enum class BehaviorResult {
+    Success,
+    Fail,
+    /// The node should keep running in the next tick
+    Running,
+};
+
+inline const char* to_string(BehaviorResult result) {
+    switch (result) {
+        case BehaviorResult::Success: return "Success";
+        case BehaviorResult::Fail: return "Fail";
+        default: return "Running";
+    }
+}
+
+using BBMap = std::unordered_map<std::string, BlackboardValue>;
+
+struct Context;
+struct BehaviorNodeContainer;
+
+class BehaviorNode {
+public:
+    virtual ~BehaviorNode() = default;
+    virtual BehaviorResult tick(Context& context) = 0;
+    /// Called when the parent stops ticking the node while it is Running, so that
+    /// the next tick starts over. The children are halted by the container.
+    virtual void halt() {}
+    /// Describes the execution state of the node for snapshots, such as the child
+    /// it resumes from. Empty if the node keeps no state between ticks.
+    virtual std::string state() const {
+        return {};
+    }
+};
+
+/// A node that can be a child of a `UtilitySelector` without a score port,
+/// scoring itself against the blackboard.
+class ScorerNode : public BehaviorNode {
+public:
+    virtual double score(Context& context) = 0;
+};
+
+template<typename T>
+std::string field_to_string(const void* field) {
+    auto& value = *static_cast<const T*>(field);
+    if constexpr (std::is_same_v<T, std::string>) {
+        return value;
+    }
+    else if constexpr (std::is_same_v<T, bool>) {
+        return value ? "true" : "false";
+    }
+    else {
+        return std::to_string(value);
+    }
+}
+
+template<typename T>
+void field_from_string(void* field, const std::string& value) {
+    auto& dest = *static_cast<T*>(field);
+    if constexpr (std::is_same_v<T, std::string>) {
+        dest = value;
+    }
+    else if constexpr (std::is_same_v<T, bool>) {
+        dest = value == "true";
+    }
+    else if constexpr (std::is_integral_v<T>) {
+        dest = static_cast<T>(std::strtoll(value.c_str(), nullptr, 10));
+    }
+    else {
+        dest = static_cast<T>(std::strtod(value.c_str(), nullptr));
+    }
+}
+
+template<typename T>
+std::shared_ptr<void> field_copy(const void* field) {
+    return std::make_shared<T>(*static_cast<const T*>(field));
+}
+
+/// A number unique to each object, which copies do not share.
+class InstanceId {
+    uint64_t value = next();
+
+    static uint64_t next() {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    }
+
+public:
+    InstanceId() = default;
+    InstanceId(const InstanceId&) {}
+    InstanceId& operator=(const InstanceId&) {
+        value = next();
+        return *this;
+    }
+
+    uint64_t get() const {
+        return value;
+    }
+};
+
+/// The node types, variable bindings and options that trees are compiled with.
+///
+/// A node type with side effects outside its ports, such as changing the user data
+/// directly or acting on the world, must skip them if `Context::shadow` is set.
+/// `ShadowExecutor` ticks candidate trees with the user data of the live agents,
+/// and only the writes through ports are kept from reaching it.
+struct Registry {
+    std::unordered_map<std::string, std::function<std::unique_ptr<BehaviorNode> ()>> node_types;
+    std::unordered_map<std::string, std::string> key_names;
+    std::unordered_map<std::string, FieldBinding> field_bindings;
+    /// Node types without side effects: they only read the blackboard and tick their
+    /// children. Optimizations such as `AdaptiveFallback` rely on it.
+    std::unordered_set<std::string> pure_node_types;
+    /// Whether to compile the writes to variables that nothing reads to no-ops.
+    /// See `find_dead_stores()`.
+    bool eliminate_dead_stores = false;
+    /// Whether to compile the parts of trees made of Sequence, Fallback, Inverter,
+    /// ForceSuccess, ForceFailure and `if` nodes to state machines. See `FsmNode`.
+    bool compile_fsm = false;
+    /// Variables read by the application or by nodes that access the blackboard
+    /// without ports, whose writes are never eliminated
+    std::unordered_set<std::string> external_variables;
+    /// Variables that keep the values an agent is spawned with. Loading a tree for an
+    /// agent with `load(tree_source, registry, entry, blackboard)` folds their values
+    /// into the program.
+    std::unordered_set<std::string> constant_variables;
+    /// The number of programs specialized for different values of `constant_variables`
+    /// that a `TreeSource` keeps for each entry tree. Agents spawned with other values
+    /// get the program without constants, so that values such as positions or ids do
+    /// not compile and keep a program per agent.
+    size_t max_specializations = 16;
+
+    /// Binds the blackboard variable named `variable` to a field of the user data `U`.
+    ///
+    /// The ports mapped to the variable read and write the field of the user data
+    /// set by `Context::set_user()` instead of the blackboard. It applies to all the
+    /// trees loaded after the call, in any subtree scope. `U` must be a standard
+    /// layout type that can be default constructed.
+    template<typename U, typename T>
+    void bind_field(const std::string& variable, T U::* member) {
+        static_assert(std::is_standard_layout_v<U>, "The user data must be a standard layout type");
+        static_assert(std::is_default_constructible_v<U>, "The offset of the field is measured in a default constructed U");
+        // Accessing a member of an object that was not constructed is undefined
+        const U probe{};
+        auto offset = reinterpret_cast<const char*>(&(probe.*member))
+            - reinterpret_cast<const char*>(&probe);
+
+        constexpr bool convertible = std::is_arithmetic_v<T> || std::is_same_v<T, std::string>;
+        FieldBinding binding {
+            .user_type = &typeid(U),
+            .field_type = &typeid(T),
+            .offset = static_cast<size_t>(offset),
+            .to_string = nullptr,
+            .from_string = nullptr,
+            .copy = nullptr,
+        };
+        if constexpr (convertible) {
+            binding.to_string = &field_to_string<T>;
+            binding.from_string = &field_from_string<T>;
+        }
+        if constexpr (std::is_copy_constructible_v<T>) {
+            binding.copy = &field_copy<T>;
+        }
+        field_bindings.insert_or_assign(variable, binding);
+    }
+
+    /// A number unique to this registry object, so that a registry created at the
+    /// address of a destroyed one is not mistaken for it.
+    uint64_t id() const {
+        return instance.get();
+    }
+
+    /// A hash of the contents that compiling depends on, which `TreeSource::program()`
+    /// compares to find out if the registry changed since a program was cached.
+    /// Node types are compared by their names and the types of their factories, so
+    /// replacing a factory with another of the same type is not detected.
+    uint64_t fingerprint() const {
+        auto hash = [](std::string_view text) {
+            uint64_t h = 0xcbf29ce484222325ull;
+            for (unsigned char c : text) {
+                h = (h ^ c) * 0x100000001b3ull;
+            }
+            return h;
+        };
+        // Sums of the hashes of the elements, which do not depend on their order
+        uint64_t ret = (eliminate_dead_stores ? 1 : 0) | (compile_fsm ? 2 : 0);
+        auto mix = [&ret](uint64_t tag, uint64_t sum) {
+            ret = (ret ^ (sum + tag)) * 0x9E3779B97F4A7C15ull;
+        };
+        uint64_t sum = 0;
+        for (auto& [name, factory] : node_types) {
+            sum += hash(name) ^ hash(factory.target_type().name()) * 31;
+        }
+        mix(1, sum);
+        sum = 0;
+        for (auto& [name, key] : key_names) {
+            sum += hash(name) ^ hash(key) * 31;
+        }
+        mix(2, sum);
+        sum = 0;
+        for (auto& [name, binding] : field_bindings) {
+            sum += hash(name) ^ (hash(binding.user_type->name()) + binding.offset) * 31;
+        }
+        mix(3, sum);
+        int tag = 4;
+        for (auto set : { &pure_node_types, &external_variables, &constant_variables }) {
+            sum = set->size();
+            for (auto& name : *set) {
+                sum += hash(name);
+            }
+            mix(tag++, sum);
+        }
+        return ret;
+    }
+
+private:
+    InstanceId instance;
+};
+
+/// Formats a number for the string blackboard. Integral values have no decimals,
+/// so that they can be read back with `std::atoi()`.
+inline std::string format_number(double value) {
+    char buf[32];
+    if (value == std::floor(value) && std::fabs(value) < 1e15) {
+        std::snprintf(buf, sizeof buf, "%.0f", value);
+    }
+    else {
+        std::snprintf(buf, sizeof buf, "%.17g", value);
+    }
+    return buf;
+}
+
+/// Parses a value of the string blackboard as a number, where "true" is 1 and "false" is 0.
+/// Returns std::nullopt if the value is not a number.
+inline std::optional<double> to_number(const std::string& value) {
+    if (value == "true") return 1.;
+    if (value == "false") return 0.;
+    char* end = nullptr;
+    auto ret = std::strtod(value.c_str(), &end);
+    if (end == value.c_str()) return std::nullopt;
+    while (std::isspace(static_cast<unsigned char>(*end))) end++;
+    if (*end) return std::nullopt;
+    return ret;
+}
+
+/// Like `to_number()`, but returns NaN if the value is not a number.
+inline double parse_number(const std::string& value) {
+    return to_number(value).value_or(std::numeric_limits<double>::quiet_NaN());
+}
+
+/// An attached column of a `ColumnBlackboard` has no room for more agents.
+class column_capacity_error : public std::exception {
+    std::string message;
+public:
+    column_capacity_error(const std::string& name, size_t capacity) :
+        message("The array attached to the column " + name + " has room for only "
+            + std::to_string(capacity) + " agents") {}
+    const char* what() const noexcept override {
+        return message.c_str();
+    }
+};
+
+/// Blackboard variables of many agents stored as one column per variable,
+/// with a number per agent in each column.
+///
+/// It is meant for the values the application pushes to every agent each frame.
+/// A column can be filled from an array in one pass by `ingest()`, or can refer to an
+/// array owned by the application by `attach()`, in which case nothing is copied.
+/// The columns hold numbers, so writing text that is not a number to one throws
+/// `non_numeric_value_error`.
+class ColumnBlackboard {
+    struct Column {
+        std::string name;
+        std::vector<double> owned;
+        /// Either `owned.data()` or an attached array
+        double* data = nullptr;
+        /// The number of rows the attached array has room for
+        size_t capacity = 0;
+    };
+    std::vector<Column> columns;
+    std::unordered_map<std::string, size_t> index;
+    size_t rows = 0;
+
+public:
+    /// The number of agents
+    size_t size() const {
+        return rows;
+    }
+
+    /// Changes the number of agents. The new rows are zero. Throws
+    /// `column_capacity_error` without changing anything if an attached array has no
+    /// room for the rows, since it cannot grow.
+    void resize(size_t new_rows) {
+        for (auto& column : columns) {
+            if (column.data != column.owned.data() && new_rows > column.capacity) {
+                throw column_capacity_error(column.name, column.capacity);
+            }
+        }
+        for (auto& column : columns) {
+            if (column.data != column.owned.data()) {
+                if (new_rows > rows) std::fill(column.data + rows, column.data + new_rows, 0.);
+                continue;
+            }
+            column.owned.resize(new_rows);
+            column.data = column.owned.data();
+        }
+        rows = new_rows;
+    }
+
+    /// Returns the column of the variable, creating it if it does not exist.
+    double* column(const std::string& name) {
+        auto it = index.find(name);
+        if (it != index.end()) return columns[it->second].data;
+        Column column;
+        column.name = name;
+        column.owned.resize(rows);
+        column.data = column.owned.data();
+        index.emplace(name, columns.size());
+        columns.push_back(std::move(column));
+        return columns.back().data;
+    }
+
+    /// Returns the column of the variable, or nullptr.
+    const double* find(const std::string& name) const {
+        auto it = index.find(name);
+        if (it == index.end()) return nullptr;
+        return columns[it->second].data;
+    }
+
+    double* find(const std::string& name) {
+        auto it = index.find(name);
+        if (it == index.end()) return nullptr;
+        return columns[it->second].data;
+    }
+
+    /// Copies `count` values into the column of the variable, starting at the agent `first`.
+    /// Nothing is copied if `values` is the column itself.
+    template<typename T>
+    void ingest(const std::string& name, const T* values, size_t count, size_t first = 0) {
+        static_assert(std::is_arithmetic_v<T>, "Columns hold numbers");
+        auto dest = column(name) + first;
+        count = std::min(count, rows - std::min(first, rows));
+        if constexpr (std::is_same_v<T, double>) {
+            if (dest == values) return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            dest[i] = static_cast<double>(values[i]);
+        }
+    }
+
+    /// Makes the column of the variable refer to an array of `size()` values owned
+    /// by the caller, which must outlive the attachment. Writes from the agents go
+    /// to the array. If the array has room for `capacity` rows, agents can be added
+    /// up to that number without copying; beyond it `resize()` throws. The column is
+    /// detached by `detach()`.
+    void attach(const std::string& name, double* values, size_t capacity = 0) {
+        column(name);
+        auto& column = columns[index[name]];
+        column.owned.clear();
+        column.owned.shrink_to_fit();
+        column.data = values;
+        column.capacity = std::max(capacity, rows);
+    }
+
+    /// Copies the attached array of the variable into owned storage.
+    void detach(const std::string& name) {
+        auto it = index.find(name);
+        if (it == index.end()) return;
+        auto& column = columns[it->second];
+        if (column.data != column.owned.data()) {
+            column.owned.assign(column.data, column.data + rows);
+            column.data = column.owned.data();
+        }
+    }
+
+    std::vector<std::string> names() const {
+        std::vector<std::string> ret;
+        for (auto& column : columns) {
+            ret.push_back(column.name);
+        }
+        return ret;
+    }
+};
+
+class undefined_port_error : public std::exception {
+    const char* what() const noexcept override {
+        return "Attempt to assign to an undefined port";
+    }
+};
+
+class undefined_variable_error : public std::exception {
+    const char* what() const noexcept override {
+        return "Could not find the named variable";
+    }
+};
+
+class undefined_node_error : public std::exception {
+    std::string name;
+    std::string location;
+public:
+    undefined_node_error(std::string name, std::optional<SourceLocation> loc = std::nullopt) :
+        name(std::move(name)), location(loc ? to_string(*loc) : "") {}
+    const char* what() const noexcept override {
+        thread_local std::string ret;
+        ret = std::string("Could not find the node type name: ") + name;
+        if (!location.empty()) {
+            ret += " at " + location;
+        }
+        return ret.c_str();
+    }
+};
+
+class write_to_constant_error : public std::exception {
+    std::string name;
+    std::string location;
+public:
+    write_to_constant_error(std::string name, std::optional<SourceLocation> loc = std::nullopt) :
+        name(std::move(name)), location(loc ? to_string(*loc) : "") {}
+    const char* what() const noexcept override {
+        thread_local std::string ret;
+        ret = "Writing to the constant variable " + name;
+        if (!location.empty()) {
+            ret += " at " + location;
+        }
+        return ret.c_str();
+    }
+};
+
+class impure_node_error : public std::exception {
+    std::string name;
+    std::string parent;
+    std::string location;
+public:
+    impure_node_error(std::string name, std::string parent, std::optional<SourceLocation> loc = std::nullopt) :
+        name(std::move(name)), parent(std::move(parent)), location(loc ? to_string(*loc) : "") {}
+    const char* what() const noexcept override {
+        thread_local std::string ret;
+        ret = "Node type " + name + " is not declared pure, but it is in " + parent;
+        if (!location.empty()) {
+            ret += " at " + location;
+        }
+        return ret.c_str();
+    }
+};
+
+class undefined_tree_error : public std::exception {
+    std::string name;
+public:
+    undefined_tree_error(std::string name) : name(std::move(name)) {}
+    const char* what() const noexcept override {
+        thread_local std::string ret;
+        ret = std::string("Could not find the tree name: ") + name;
+        return ret.c_str();
+    }
+};
+
+class write_input_port_error : public std::exception {
+    const char* what() const noexcept override {
+        return "Attempt to assign to a input port";
+    }
+};
+
+class write_to_literal_error : public std::exception {
+    const char* what() const noexcept override {
+        return "Attempt to assign to a literal";
+    }
+};
+
+class invalid_count_error : public std::exception {
+    const char* what() const noexcept override {
+        return "Invalid count string";
+    }
+};
+
+class parse_error : public std::exception {
+    std::string message;
+public:
+    parse_error(std::string message) : message(std::move(message)) {}
+    const char* what() const noexcept override {
+        return message.c_str();
+    }
+};
+
+/// Text that is not a number was written to a variable in a `ColumnBlackboard`.
+class non_numeric_value_error : public std::exception {
+    std::string message;
+public:
+    non_numeric_value_error(const std::string& name, const std::string& value) :
+        message("Writing \"" + value + "\", which is not a number, to the column " + name) {}
+    const char* what() const noexcept override {
+        return message.c_str();
+    }
+};
+
+/// Generated C++ failed to compile or to load. The message has the output of the compiler.
+class native_compile_error : public std::exception {
+    std::string message;
+public:
+    native_compile_error(std::string message) : message(std::move(message)) {}
+    const char* what() const noexcept override {
+        return message.c_str();
+    }
+};
+
+/// A fixed size set of bits, one per agent.
+struct Bitmask {
+    std::vector<uint64_t> words;
+    size_t size = 0;
+
+    Bitmask() = default;
+    explicit Bitmask(size_t size) : words((size + 63) / 64), size(size) {}
+
+    bool test(size_t i) const {
+        return (words[i / 64] >> (i % 64)) & 1;
+    }
+
+    void set(size_t i) {
+        words[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    /// Clears the bits past `size` in the last word.
+    void trim() {
+        if (size % 64) {
+            words.back() &= (uint64_t(1) << (size % 64)) - 1;
+        }
+    }
+};
+
+enum class CompareOp {
+    Lt,
+    Le,
+    Gt,
+    Ge,
+    Eq,
+    Ne,
+};
+
+template<CompareOp op>
+inline bool compare_scalar(double a, double b) {
+    if constexpr (op == CompareOp::Lt) return a < b;
+    else if constexpr (op == CompareOp::Le) return a <= b;
+    else if constexpr (op == CompareOp::Gt) return a > b;
+    else if constexpr (op == CompareOp::Ge) return a >= b;
+    else if constexpr (op == CompareOp::Eq) return a == b;
+    else return std::islessgreater(a, b);
+}
+
+/// Compares `a[i]` against `b[i]`, or against `constant` if `b` is nullptr,
+/// writing bit i of `out` for each of the `n` elements.
+template<CompareOp op>
+void compare_kernel_scalar(const double* a, const double* b, double constant, size_t n, uint64_t* out) {
+    for (size_t w = 0; w * 64 < n; w++) {
+        uint64_t word = 0;
+        auto end = std::min<size_t>(64, n - w * 64);
+        for (size_t j = 0; j < end; j++) {
+            auto i = w * 64 + j;
+            word |= uint64_t(compare_scalar<op>(a[i], b ? b[i] : constant)) << j;
+        }
+        out[w] = word;
+    }
+}
+
+#if BEHAVIOR_TREE_LITE_X86_SIMD
+template<CompareOp op>
+inline __m128d compare_sse2(__m128d a, __m128d b) {
+    if constexpr (op == CompareOp::Lt) return _mm_cmplt_pd(a, b);
+    else if constexpr (op == CompareOp::Le) return _mm_cmple_pd(a, b);
+    else if constexpr (op == CompareOp::Gt) return _mm_cmpgt_pd(a, b);
+    else if constexpr (op == CompareOp::Ge) return _mm_cmpge_pd(a, b);
+    else if constexpr (op == CompareOp::Eq) return _mm_cmpeq_pd(a, b);
+    // _mm_cmpneq_pd is true for NaN
+    else return _mm_or_pd(_mm_cmplt_pd(a, b), _mm_cmpgt_pd(a, b));
+}
+
+template<CompareOp op>
+void compare_kernel_sse2(const double* a, const double* b, double constant, size_t n, uint64_t* out) {
+    auto c = _mm_set1_pd(constant);
+    size_t full = n / 64;
+    for (size_t w = 0; w < full; w++) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 64; j += 2) {
+            auto i = w * 64 + j;
+            auto x = _mm_loadu_pd(a + i);
+            auto y = b ? _mm_loadu_pd(b + i) : c;
+            word |= uint64_t(_mm_movemask_pd(compare_sse2<op>(x, y))) << j;
+        }
+        out[w] = word;
+    }
+    if (full * 64 < n) {
+        compare_kernel_scalar<op>(a + full * 64, b ? b + full * 64 : nullptr, constant, n - full * 64, out + full);
+    }
+}
+
+template<CompareOp op>
+constexpr int avx_predicate() {
+    if constexpr (op == CompareOp::Lt) return _CMP_LT_OQ;
+    else if constexpr (op == CompareOp::Le) return _CMP_LE_OQ;
+    else if constexpr (op == CompareOp::Gt) return _CMP_GT_OQ;
+    else if constexpr (op == CompareOp::Ge) return _CMP_GE_OQ;
+    else if constexpr (op == CompareOp::Eq) return _CMP_EQ_OQ;
+    else return _CMP_NEQ_OQ;
+}
+
+/// Compiled for AVX regardless of the compiler flags, and only called if the CPU supports it.
+template<CompareOp op>
+__attribute__((target("avx")))
+void compare_kernel_avx(const double* a, const double* b, double constant, size_t n, uint64_t* out) {
+    // A constant, since the intrinsic takes an immediate even without optimization
+    constexpr int predicate = avx_predicate<op>();
+    auto c = _mm256_set1_pd(constant);
+    size_t full = n / 64;
+    for (size_t w = 0; w < full; w++) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 64; j += 4) {
+            auto i = w * 64 + j;
+            auto x = _mm256_loadu_pd(a + i);
+            auto y = b ? _mm256_loadu_pd(b + i) : c;
+            word |= uint64_t(_mm256_movemask_pd(_mm256_cmp_pd(x, y, predicate))) << j;
+        }
+        out[w] = word;
+    }
+    if (full * 64 < n) {
+        compare_kernel_scalar<op>(a + full * 64, b ? b + full * 64 : nullptr, constant, n - full * 64, out + full);
+    }
+}
+
+inline bool cpu_has_avx() {
+    static const bool ret = __builtin_cpu_supports("avx");
+    return ret;
+}
+#endif
+
+template<CompareOp op>
+void compare_kernel(const double* a, const double* b, double constant, size_t n, uint64_t* out) {
+#if BEHAVIOR_TREE_LITE_X86_SIMD
+    if (cpu_has_avx()) {
+        compare_kernel_avx<op>(a, b, constant, n, out);
+    }
+    else {
+        compare_kernel_sse2<op>(a, b, constant, n, out);
+    }
+#else
+    compare_kernel_scalar<op>(a, b, constant, n, out);
+#endif
+}
+
+inline void compare_kernel(CompareOp op, const double* a, const double* b, double constant, size_t n, uint64_t* out) {
+    switch (op) {
+        case CompareOp::Lt: compare_kernel<CompareOp::Lt>(a, b, constant, n, out); break;
+        case CompareOp::Le: compare_kernel<CompareOp::Le>(a, b, constant, n, out); break;
+        case CompareOp::Gt: compare_kernel<CompareOp::Gt>(a, b, constant, n, out); break;
+        case CompareOp::Ge: compare_kernel<CompareOp::Ge>(a, b, constant, n, out); break;
+        case CompareOp::Eq: compare_kernel<CompareOp::Eq>(a, b, constant, n, out); break;
+        case CompareOp::Ne: compare_kernel<CompareOp::Ne>(a, b, constant, n, out); break;
+    }
+}
+
+/// Writes the index of the largest of `scores[j][i]` over j to `best[i]` for each
+/// of the `n` rows. A score column of nullptr is the constant `constants[j]`.
+/// The first of equal scores wins, and NaN never wins.
+inline void argmax_kernel_scalar(const std::vector<const double*>& scores, const std::vector<double>& constants,
+    size_t begin, size_t n, uint32_t* best)
+{
+    for (size_t i = begin; i < n; i++) {
+        double best_score = -INFINITY;
+        uint32_t best_index = 0;
+        for (size_t j = 0; j < scores.size(); j++) {
+            auto score = scores[j] ? scores[j][i] : constants[j];
+            if (score > best_score) {
+                best_score = score;
+                best_index = static_cast<uint32_t>(j);
+            }
+        }
+        best[i] = best_index;
+    }
+}
+
+inline void argmax_kernel(const std::vector<const double*>& scores, const std::vector<double>& constants,
+    size_t n, uint32_t* best)
+{
+#if BEHAVIOR_TREE_LITE_X86_SIMD
+    size_t full = n / 2 * 2;
+    for (size_t i = 0; i < full; i += 2) {
+        auto best_score = _mm_set1_pd(-INFINITY);
+        auto best_index = _mm_setzero_pd();
+        for (size_t j = 0; j < scores.size(); j++) {
+            auto score = scores[j] ? _mm_loadu_pd(scores[j] + i) : _mm_set1_pd(constants[j]);
+            auto greater = _mm_cmpgt_pd(score, best_score);
+            best_score = _mm_or_pd(_mm_and_pd(greater, score), _mm_andnot_pd(greater, best_score));
+            best_index = _mm_or_pd(_mm_and_pd(greater, _mm_set1_pd(double(j))), _mm_andnot_pd(greater, best_index));
+        }
+        alignas(16) int32_t index[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(index), _mm_cvttpd_epi32(best_index));
+        best[i] = index[0];
+        best[i + 1] = index[1];
+    }
+    argmax_kernel_scalar(scores, constants, full, n, best);
+#else
+    argmax_kernel_scalar(scores, constants, 0, n, best);
+#endif
+}
+
+/// A condition over numeric blackboard variables, such as `hp < 10 && ammo > 0`.
+///
+/// It supports comparisons (`<`, `<=`, `>`, `>=`, `==`, `!=`) between variables and
+/// number literals, `&&`, `||`, `!`, parentheses, `true`, `false` and bare variables,
+/// which are true if they are not zero. A missing or non-numeric variable is NaN,
+/// which compares false with every operator including `!=`, and is not true by
+/// itself, so `x != 5` and `x` are both false if there is no `x`.
+///
+/// It can be evaluated for one agent, or for all the agents in a `ColumnBlackboard`
+/// at once, in which case the comparisons run on SIMD registers.
+class Expression {
+public:
+    enum class Kind {
+        Compare,
+        Truthy,
+        Const,
+        Not,
+        And,
+        Or,
+    };
+
+    struct Operand {
+        /// The variable name, or empty for a number literal
+        std::string name;
+        double value = 0.;
+    };
+
+    struct Node {
+        Kind kind;
+        CompareOp op = CompareOp::Eq;
+        Operand lhs = {};
+        Operand rhs = {};
+        /// Indices of the operands of Not, And and Or
+        size_t a = 0;
+        size_t b = 0;
+    };
+
+    /// The root is the last node.
+    std::vector<Node> nodes;
+
+    /// The text the expression was parsed from
+    std::string text;
+
+    /// Parses the whole text as an expression.
+    static std::variant<Expression, std::string> parse(std::string_view text) {
+        Expression ret;
+        ret.text = std::string(text);
+        auto res = ret.parse_or(text);
+        if (auto e = std::get_if<1>(&res)) return *e;
+        auto rest = space(std::get<0>(res).first).first;
+        if (!rest.empty()) {
+            return std::string("Unexpected text in expression: ") + std::string(rest);
+        }
+        return ret;
+    }
+
+    /// The names of the variables the expression reads
+    std::vector<std::string> variables() const {
+        std::vector<std::string> ret;
+        auto add = [&ret](const std::string& name) {
+            if (!name.empty() && std::find(ret.begin(), ret.end(), name) == ret.end()) {
+                ret.push_back(name);
+            }
+        };
+        for (auto& node : nodes) {
+            add(node.lhs.name);
+            add(node.rhs.name);
+        }
+        return ret;
+    }
+
+    /// Evaluates for one agent. `lookup(name)` returns the value of a variable,
+    /// or NaN if it does not exist.
+    template<typename Lookup>
+    bool evaluate(Lookup&& lookup) const {
+        return evaluate_node(nodes.size() - 1, lookup);
+    }
+
+    /// Evaluates for every row of the columns. Returns std::nullopt if a variable
+    /// is not in the columns.
+    std::optional<Bitmask> evaluate_batch(const ColumnBlackboard& columns) const {
+        for (auto& node : nodes) {
+            for (auto operand : {&node.lhs, &node.rhs}) {
+                if (!operand->name.empty() && !columns.find(operand->name)) return std::nullopt;
+            }
+        }
+        std::vector<Bitmask> masks;
+        masks.reserve(nodes.size());
+        auto n = columns.size();
+        for (auto& node : nodes) {
+            Bitmask mask(n);
+            switch (node.kind) {
+                case Kind::Compare: {
+                    auto lhs = column_or_null(columns, node.lhs);
+                    auto rhs = column_or_null(columns, node.rhs);
+                    if (lhs) {
+                        compare_kernel(node.op, lhs, rhs, node.rhs.value, n, mask.words.data());
+                    }
+                    else if (rhs) {
+                        compare_kernel(flip(node.op), rhs, nullptr, node.lhs.value, n, mask.words.data());
+                    }
+                    else {
+                        fill(mask, compare(node.op, node.lhs.value, node.rhs.value));
+                    }
+                    break;
+                }
+                case Kind::Truthy:
+                    compare_kernel(CompareOp::Ne, columns.find(node.lhs.name), nullptr, 0., n, mask.words.data());
+                    break;
+                case Kind::Const:
+                    fill(mask, node.lhs.value != 0.);
+                    break;
+                case Kind::Not:
+                    for (size_t w = 0; w < mask.words.size(); w++) {
+                        mask.words[w] = ~masks[node.a].words[w];
+                    }
+                    break;
+                case Kind::And:
+                    for (size_t w = 0; w < mask.words.size(); w++) {
+                        mask.words[w] = masks[node.a].words[w] & masks[node.b].words[w];
+                    }
+                    break;
+                case Kind::Or:
+                    for (size_t w = 0; w < mask.words.size(); w++) {
+                        mask.words[w] = masks[node.a].words[w] | masks[node.b].words[w];
+                    }
+                    break;
+            }
+            mask.trim();
+            masks.push_back(std::move(mask));
+        }
+        return std::move(masks.back());
+    }
+
+    /// Replaces the variables whose values `lookup(name)` returns with the values,
+    /// and simplifies the parts that become constant. Variables for which it returns
+    /// std::nullopt are kept.
+    template<typename Lookup>
+    Expression fold(Lookup&& lookup) const {
+        Expression ret;
+        // Index in ret.nodes of each node
+        std::vector<size_t> folded(nodes.size());
+        auto constant = [&ret](size_t i) -> std::optional<bool> {
+            auto& node = ret.nodes[i];
+            if (node.kind != Kind::Const) return std::nullopt;
+            return node.lhs.value != 0.;
+        };
+        auto make_const = [](bool value) {
+            return Node{ .kind = Kind::Const, .lhs = Operand{ "", value ? 1. : 0. } };
+        };
+        for (size_t i = 0; i < nodes.size(); i++) {
+            auto node = nodes[i];
+            for (auto operand : {&node.lhs, &node.rhs}) {
+                if (operand->name.empty()) continue;
+                if (auto value = lookup(operand->name)) {
+                    operand->name.clear();
+                    operand->value = *value;
+                }
+            }
+            switch (node.kind) {
+                case Kind::Compare:
+                    if (node.lhs.name.empty() && node.rhs.name.empty()) {
+                        node = make_const(compare(node.op, node.lhs.value, node.rhs.value));
+                    }
+                    break;
+                case Kind::Truthy:
+                    if (node.lhs.name.empty()) node = make_const(compare(CompareOp::Ne, node.lhs.value, 0.));
+                    break;
+                case Kind::Const:
+                    break;
+                case Kind::Not:
+                    node.a = folded[node.a];
+                    if (auto a = constant(node.a)) node = make_const(!*a);
+                    break;
+                case Kind::And:
+                case Kind::Or: {
+                    node.a = folded[node.a];
+                    node.b = folded[node.b];
+                    // The value that decides the result by itself
+                    bool dominant = node.kind == Kind::Or;
+                    auto a = constant(node.a), b = constant(node.b);
+                    if (a == dominant || b == dominant) {
+                        node = make_const(dominant);
+                    }
+                    else if (a) {
+                        folded[i] = node.b;
+                        continue;
+                    }
+                    else if (b) {
+                        folded[i] = node.a;
+                        continue;
+                    }
+                    break;
+                }
+            }
+            folded[i] = ret.push(std::move(node));
+        }
+        // Parse the text again to drop the nodes that were folded away
+        auto text = ret.to_string_node(folded.back());
+        return std::get<Expression>(parse(text));
+    }
+
+    /// Formats the expression as text that parses to the same expression.
+    std::string to_string() const {
+        return to_string_node(nodes.size() - 1);
+    }
+
+    static bool compare(CompareOp op, double a, double b) {
+        switch (op) {
+            case CompareOp::Lt: return a < b;
+            case CompareOp::Le: return a <= b;
+            case CompareOp::Gt: return a > b;
+            case CompareOp::Ge: return a >= b;
+            case CompareOp::Eq: return a == b;
+            case CompareOp::Ne: return std::islessgreater(a, b);
+        }
+        return false;
+    }
+
+private:
+    std::string to_string_node(size_t index) const {
+        auto& node = nodes[index];
+        auto operand = [](const Operand& operand) {
+            return operand.name.empty() ? format_number(operand.value) : operand.name;
+        };
+        switch (node.kind) {
+            case Kind::Compare: {
+                static const char* ops[] = { "<", "<=", ">", ">=", "==", "!=" };
+                return operand(node.lhs) + " " + ops[static_cast<int>(node.op)] + " " + operand(node.rhs);
+            }
+            case Kind::Truthy:
+            case Kind::Const:
+                return operand(node.lhs);
+            case Kind::Not:
+                return "!(" + to_string_node(node.a) + ")";
+            case Kind::And:
+                return "(" + to_string_node(node.a) + " && " + to_string_node(node.b) + ")";
+            case Kind::Or:
+                return "(" + to_string_node(node.a) + " || " + to_string_node(node.b) + ")";
+        }
+        return "";
+    }
+
+    static CompareOp flip(CompareOp op) {
+        switch (op) {
+            case CompareOp::Lt: return CompareOp::Gt;
+            case CompareOp::Le: return CompareOp::Ge;
+            case CompareOp::Gt: return CompareOp::Lt;
+            case CompareOp::Ge: return CompareOp::Le;
+            default: return op;
+        }
+    }
+
+    static const double* column_or_null(const ColumnBlackboard& columns, const Operand& operand) {
+        return operand.name.empty() ? nullptr : columns.find(operand.name);
+    }
+
+    static void fill(Bitmask& mask, bool value) {
+        std::fill(mask.words.begin(), mask.words.end(), value ? ~uint64_t(0) : 0);
+    }
+
+    template<typename Lookup>
+    bool evaluate_node(size_t index, Lookup& lookup) const {
+        auto& node = nodes[index];
+        auto value = [&lookup](const Operand& operand) {
+            return operand.name.empty() ? operand.value : static_cast<double>(lookup(operand.name));
+        };
+        switch (node.kind) {
+            case Kind::Compare: return compare(node.op, value(node.lhs), value(node.rhs));
+            case Kind::Truthy: return compare(CompareOp::Ne, value(node.lhs), 0.);
+            case Kind::Const: return node.lhs.value != 0.;
+            case Kind::Not: return !evaluate_node(node.a, lookup);
+            case Kind::And: return evaluate_node(node.a, lookup) && evaluate_node(node.b, lookup);
+            case Kind::Or: return evaluate_node(node.a, lookup) || evaluate_node(node.b, lookup);
+        }
+        return false;
+    }
+
+    size_t push(Node node) {
+        nodes.push_back(std::move(node));
+        return nodes.size() - 1;
+    }
+
+    IResult<Operand> parse_operand(std::string_view i) {
+        i = space(i).first;
+        auto ident_res = identifier(i);
+        if (auto ident = std::get_if<0>(&ident_res)) {
+            if (ident->second == "true" || ident->second == "false") {
+                return std::make_pair(ident->first, Operand{ "", ident->second == "true" ? 1. : 0. });
+            }
+            return std::make_pair(ident->first, Operand{ std::string(ident->second), 0. });
+        }
+        auto r = i;
+        if (!r.empty() && r[0] == '-') r = r.substr(1);
+        auto digits = [](std::string_view s) {
+            while (!s.empty() && (isdigit(s[0]) || s[0] == '.')) s = s.substr(1);
+            return s;
+        };
+        auto rest = digits(r);
+        if (rest.size() != r.size() && !rest.empty() && (rest[0] == 'e' || rest[0] == 'E')) {
+            auto exponent = rest.substr(1);
+            if (!exponent.empty() && (exponent[0] == '-' || exponent[0] == '+')) exponent = exponent.substr(1);
+            auto after = digits(exponent);
+            if (after.size() != exponent.size()) rest = after;
+        }
+        if (rest.size() == r.size()) {
+            return std::string("Expected a variable or a number");
+        }
+        auto literal = std::string(i.substr(0, rest.data() - i.data()));
+        return std::make_pair(rest, Operand{ "", std::strtod(literal.c_str(), nullptr) });
+    }
+
+    IResult<size_t> parse_comparison(std::string_view i) {
+        auto res = parse_operand(i);
+        if (auto e = std::get_if<1>(&res)) return *e;
+        auto [r, lhs] = std::get<0>(res);
+        r = space(r).first;
+        static const std::pair<std::string_view, CompareOp> ops[] = {
+            {"<=", CompareOp::Le}, {">=", CompareOp::Ge}, {"==", CompareOp::Eq},
+            {"!=", CompareOp::Ne}, {"<", CompareOp::Lt}, {">", CompareOp::Gt},
+        };
+        for (auto& [token, op] : ops) {
+            if (r.substr(0, token.size()) == token) {
+                auto res2 = parse_operand(r.substr(token.size()));
+                if (auto e = std::get_if<1>(&res2)) return *e;
+                auto [r2, rhs] = std::get<0>(res2);
+                return std::make_pair(r2, push(Node{ .kind = Kind::Compare, .op = op, .lhs = lhs, .rhs = rhs }));
+            }
+        }
+        if (lhs.name.empty()) {
+            return std::make_pair(r, push(Node{ .kind = Kind::Const, .lhs = lhs }));
+        }
+        return std::make_pair(r, push(Node{ .kind = Kind::Truthy, .lhs = lhs }));
+    }
+
+    IResult<size_t> parse_unary(std::string_view i) {
+        i = space(i).first;
+        if (!i.empty() && i[0] == '!' && i.substr(0, 2) != "!=") {
+            auto res = parse_unary(i.substr(1));
+            if (auto e = std::get_if<1>(&res)) return *e;
+            auto [r, a] = std::get<0>(res);
+            return std::make_pair(r, push(Node{ .kind = Kind::Not, .a = a }));
+        }
+        if (!i.empty() && i[0] == '(') {
+            auto res = parse_or(i.substr(1));
+            if (auto e = std::get_if<1>(&res)) return *e;
+            auto [r, a] = std::get<0>(res);
+            auto res2 = match_char<')'>(r);
+            if (auto e = std::get_if<1>(&res2)) return *e;
+            return std::make_pair(std::get<0>(res2).first, a);
+        }
+        return parse_comparison(i);
+    }
+
+    template<Kind kind, char C>
+    IResult<size_t> parse_binary(std::string_view i, IResult<size_t> (Expression::*operand)(std::string_view)) {
+        auto res = (this->*operand)(i);
+        if (auto e = std::get_if<1>(&res)) return *e;
+        auto [r, a] = std::get<0>(res);
+        while (true) {
+            auto next = space(r).first;
+            if (next.size() < 2 || next[0] != C || next[1] != C) break;
+            auto res2 = (this->*operand)(next.substr(2));
+            if (auto e = std::get_if<1>(&res2)) return *e;
+            auto [r2, b] = std::get<0>(res2);
+            a = push(Node{ .kind = kind, .a = a, .b = b });
+            r = r2;
+        }
+        return std::make_pair(r, a);
+    }
+
+    IResult<size_t> parse_and(std::string_view i) {
+        return parse_binary<Kind::And, '&'>(i, &Expression::parse_unary);
+    }
+
+    IResult<size_t> parse_or(std::string_view i) {
+        return parse_binary<Kind::Or, '|'>(i, &Expression::parse_and);
+    }
+};
+
+/// The node inputs an `Executor` evaluates for all of its agents at the start of each
+/// frame: the `Condition` expressions, keyed by their text, and the scores of the
+/// `UtilitySelector`s.
+struct BatchConditions {
+    struct Condition {
+        Expression expression;
+        Bitmask mask;
+        /// Whether `mask` is up to date for the current frame
+        bool valid = false;
+    };
+    std::unordered_map<std::string, Condition> conditions;
+
+    struct Selection {
+        /// The variable of each score, or an empty name for the constant in `constants`
+        std::vector<std::string> scores;
+        std::vector<double> constants;
+        /// The index of the highest score for each agent
+        std::vector<uint32_t> best;
+        bool valid = false;
+    };
+    std::unordered_map<std::string, Selection> selections;
+
+    /// Returns the condition, adding it to be evaluated from the next frame if it is new.
+    const Condition& find_or_add(const Expression& expression) {
+        auto it = conditions.find(expression.text);
+        if (it == conditions.end()) {
+            it = conditions.emplace(expression.text, Condition{ expression, {} }).first;
+        }
+        return it->second;
+    }
+
+    /// Returns the selection among the scores, adding it to be evaluated from the
+    /// next frame if it is new. `key` identifies the scores.
+    const Selection& find_or_add(const std::string& key, const Selection& selection) {
+        auto it = selections.find(key);
+        if (it == selections.end()) {
+            it = selections.emplace(key, selection).first;
+        }
+        return it->second;
+    }
+
+    void evaluate(const ColumnBlackboard& columns) {
+        for (auto& [_, condition] : conditions) {
+            auto mask = condition.expression.evaluate_batch(columns);
+            condition.valid = mask.has_value();
+            if (mask) condition.mask = std::move(*mask);
+        }
+        for (auto& [_, selection] : selections) {
+            std::vector<const double*> scores;
+            selection.valid = true;
+            for (auto& name : selection.scores) {
+                auto column = name.empty() ? nullptr : columns.find(name);
+                if (!name.empty() && !column) selection.valid = false;
+                scores.push_back(column);
+            }
+            if (!selection.valid) continue;
+            selection.best.resize(columns.size());
+            argmax_kernel(scores, selection.constants, columns.size(), selection.best.data());
+        }
+    }
+};
+
+/// Returns a number identifying a tick, unique in the process and never 0.
+/// Each thread takes the numbers from a block of its own, so that it does not
+/// contend with the other threads for each tick.
+inline uint64_t new_generation() {
+    static std::atomic<uint64_t> next_block{1};
+    constexpr uint64_t block_size = 1 << 16;
+    thread_local uint64_t next = 0, end = 0;
+    if (next == end) {
+        next = next_block.fetch_add(1, std::memory_order_relaxed) * block_size;
+        end = next + block_size;
+    }
+    return next++;
+}
+
+struct Context {
+    Blackboard blackboard;
+    BBMap *blackboard_map = nullptr;
+    std::vector<BehaviorNodeContainer>* child_nodes = nullptr;
+//    bool strict;
+    /// The user data given by `set_user()`
+    void* user_data = nullptr;
+    const std::type_info* user_type = nullptr;
+    /// The columns shared with other agents and the row of this agent in them.
+    /// A variable in the columns hides the one with the same name in `blackboard`.
+    ColumnBlackboard* columns = nullptr;
+    size_t row = 0;
+    /// The node inputs evaluated for all the agents in the columns, if enabled by the executor
+    BatchConditions* batch = nullptr;
+    /// Identifies the current tick by `new_generation()`. The results of the shared
+    /// condition nodes are cached only within a tick, and not at all if it is 0.
+    uint64_t generation = 0;
+    /// Counts the writes by `set()` and `set_field()`, which invalidate the cached results
+    uint64_t writes = 0;
+    /// Whether the tree is ticked in the shadow of a live one, see `ShadowExecutor`.
+    /// Writes to the variables bound to fields go to `shadow_fields` instead of the
+    /// user data, and nodes with external side effects must skip them.
+    bool shadow = false;
+    /// The fields written by a shadow tree, which hide the fields of the user data
+    /// from it. Writes to fields that cannot be copied are dropped.
+    struct ShadowField {
+        size_t offset;
+        const std::type_info* type;
+        std::shared_ptr<void> value;
+    };
+    std::vector<ShadowField> shadow_fields = {};
+
+    /// Sets the user data, which the nodes can get by `user()`, and which the
+    /// variables bound by `Registry::bind_field()` refer to.
+    template<typename T>
+    void set_user(T* data) {
+        user_data = data;
+        user_type = &typeid(T);
+    }
+
+    /// Returns the user data if it is of type T, or nullptr.
+    template<typename T>
+    T* user() const {
+        if (!user_type || *user_type != typeid(T)) return nullptr;
+        return static_cast<T*>(user_data);
+    }
+
+    /// Returns the field of the user data, or nullptr if the user data is not
+    /// of the type the binding expects.
+    void* field(const FieldBinding& binding) const {
+        if (!user_type || *user_type != *binding.user_type) return nullptr;
+        if (shadow) {
+            for (auto& field : shadow_fields) {
+                if (field.offset == binding.offset && *field.type == *binding.field_type) return field.value.get();
+            }
+        }
+        return static_cast<char*>(user_data) + binding.offset;
+    }
+
+    /// Returns the field to write, which is a copy in `shadow_fields` for a shadow
+    /// tree, or nullptr if the write is dropped.
+    void* writable_field(const FieldBinding& binding) {
+        auto dest = field(binding);
+        if (!dest || !shadow) return dest;
+        for (auto& field : shadow_fields) {
+            if (field.value.get() == dest) return dest;
+        }
+        if (!binding.copy) return nullptr;
+        shadow_fields.push_back(ShadowField{ binding.offset, binding.field_type, binding.copy(dest) });
+        return shadow_fields.back().value.get();
+    }
+
+    /// Looks up a port of the current node. The returned pointer stays valid while
+    /// the node exists, so a node can look it up once and pass it to `get_field()`.
+    const BlackboardValue* port(const std::string& port_name) const {
+        auto var_it = blackboard_map->find(port_name);
+        if (var_it == blackboard_map->end()) return nullptr;
+        return &var_it->second;
+    }
+
+    /// Returns the field bound to the port, or nullptr if the port is not mapped to
+    /// a field of type T. The field is neither converted nor copied.
+    template<typename T>
+    const T* get_field(const BlackboardValue* port) const {
+        auto x = port ? std::get_if<FieldPort>(port) : nullptr;
+        if (!x || x->ty == PortType::Output || *x->binding.field_type != typeid(T)) return nullptr;
+        return static_cast<const T*>(field(x->binding));
+    }
+
+    template<typename T>
+    const T* get_field(const std::string& port_name) const {
+        return get_field<T>(port(port_name));
+    }
+
+    /// Writes the field bound to the port. Returns false if the port is not mapped to
+    /// a field of type T.
+    template<typename T>
+    bool set_field(const BlackboardValue* port, T value) {
+        auto x = port ? std::get_if<FieldPort>(port) : nullptr;
+        if (!x || *x->binding.field_type != typeid(T)) return false;
+        if (x->ty == PortType::Input) {
+            throw write_input_port_error{};
+        }
+        if (!field(x->binding)) return false;
+        if (auto dest = static_cast<T*>(writable_field(x->binding))) *dest = std::move(value);
+        writes++;
+        return true;
+    }
+
+    template<typename T>
+    bool set_field(const std::string& port_name, T value) {
+        return set_field<T>(port(port_name), std::move(value));
+    }
+
+    /// Reads the port as a number. Unlike `get()`, it does not allocate a string
+    /// for a variable in the columns or bound to a numeric field.
+    std::optional<double> get_number(const std::string& port_name) const {
+        auto value = port(port_name);
+        if (!value) return std::nullopt;
+        return read_number(*value);
+    }
+
+    /// Reads a compiled port value as a number, like `get_number()`.
+    std::optional<double> read_number(const BlackboardValue& value) const {
+        if (auto x = std::get_if<0>(&value)) {
+            if (x->second == PortType::Output) return std::nullopt;
+            if (auto column = columns ? columns->find(x->first) : nullptr) {
+                return column[row];
+            }
+        }
+        else if (auto x = std::get_if<FieldPort>(&value)) {
+            if (x->ty == PortType::Output) return std::nullopt;
+            if (auto v = get_field<double>(&value)) return *v;
+            if (auto v = get_field<float>(&value)) return *v;
+            if (auto v = get_field<int>(&value)) return *v;
+            if (auto v = get_field<bool>(&value)) return *v ? 1. : 0.;
+        }
+        auto str = read(value);
+        if (!str) return std::nullopt;
+        return parse_number(*str);
+    }
+
+    std::optional<std::string> get(const std::string& port_name) const {
+        auto value = port(port_name);
+        if (!value) return std::nullopt;
+        return read(*value);
+    }
+
+    /// Reads a compiled port value, like `get()`.
+    std::optional<std::string> read(const BlackboardValue& value) const {
+        if (auto x = std::get_if<0>(&value)) {
+            if (x->second == PortType::Output) return std::nullopt;
+            if (auto column = columns ? columns->find(x->first) : nullptr) {
+                return format_number(column[row]);
+            }
+            auto y = blackboard.find(x->first);
+            if (y == blackboard.end()) return std::nullopt;
+            return y->second;
+        }
+        if (auto x = std::get_if<1>(&value)) {
+            return *x;
+        }
+        if (auto x = std::get_if<FieldPort>(&value)) {
+            if (x->ty == PortType::Output || !x->binding.to_string) return std::nullopt;
+            auto src = field(x->binding);
+            if (!src) return std::nullopt;
+            return x->binding.to_string(src);
+        }
+        return std::nullopt;
+    }
+
+    void set(const std::string& port_name, const std::string& value) {
+        auto var_it = blackboard_map->find(port_name);
+        if (var_it == blackboard_map->end()) {
+            throw undefined_port_error{};
+        }
+        if (std::get_if<DiscardedPort>(&var_it->second)) {
+            return;
+        }
+        writes++;
         if (auto x = std::get_if<0>(&var_it->second)) {
             if (x->second == PortType::Input) {
                 throw write_input_port_error{};
             }
-            blackboard[x->first] = value;
-            return;
+            if (auto column = columns ? columns->find(x->first) : nullptr) {
+                auto number = to_number(value);
+                if (!number) throw non_numeric_value_error(x->first, value);
+                column[row] = *number;
+                return;
+            }
+            blackboard[x->first] = value;
+            return;
+        }
+        if (auto x = std::get_if<FieldPort>(&var_it->second)) {
+            if (x->ty == PortType::Input) {
+                throw write_input_port_error{};
+            }
+            if (!field(x->binding) || !x->binding.from_string) {
+                throw undefined_variable_error{};
+            }
+            if (auto dest = writable_field(x->binding)) x->binding.from_string(dest, value);
+            return;
+        }
+        throw write_to_literal_error{};
+    }
+
+    std::optional<BehaviorResult> tick_child(int idx);
+};
+
+/// The nodes being ticked on a thread, from the root, as ids of their labels in
+/// `SamplingProfiler`. Only the first `max_depth` levels are kept. A signal handler
+/// on the same thread may read it at any time.
+struct NodePath {
+    static constexpr uint32_t max_depth = 64;
+    uint32_t depth = 0;
+    uint32_t ids[max_depth] = {};
+};
+
+inline thread_local NodePath node_path;
+
+/// Pushes a node to the `node_path` of the thread for its lifetime. Nodes only push
+/// themselves while the profiler is sampling.
+struct NodePathScope {
+    explicit NodePathScope(uint32_t id) {
+        auto depth = node_path.depth;
+        if (depth < NodePath::max_depth) node_path.ids[depth] = id;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        node_path.depth = depth + 1;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+    ~NodePathScope() {
+        node_path.depth--;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    }
+};
+
+/// A profiler that samples the `node_path` of the running thread on SIGPROF, which
+/// the kernel sends for every period of CPU time the process consumes. The samples
+/// are aggregated into folded stacks of the labels of the nodes, `name@file:line`,
+/// which flame graph tools take.
+///
+/// The signal handler only copies the path into a ring of samples, and `collect()`
+/// aggregates them. Call it at least once per `ring_size` samples, such as every
+/// frame or every few seconds, or the oldest samples are dropped.
+///
+/// It needs `BEHAVIOR_TREE_LITE_PROFILER` defined to 1 before including this header,
+/// so a production build that is to be profiled must define it. Then each tick of a
+/// node checks a flag, and pushes the node to the path only while the profiler is
+/// sampling. Without the macro, `start()` does nothing and returns false.
+class SamplingProfiler {
+public:
+    static constexpr size_t ring_size = 4096;
+
+private:
+    struct Sample {
+        /// The index of the sample plus one, or 0 while it is being written
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint32_t> depth{0};
+        std::atomic<uint32_t> ids[NodePath::max_depth];
+    };
+
+    struct State {
+        std::mutex mutex;
+        std::unordered_map<std::string, uint32_t> label_ids;
+        /// The labels by id. Id 0 is a node ticked before the profiler started.
+        std::vector<std::string> labels{"?"};
+        /// Keeps the source maps of the interned nodes alive, so that their
+        /// addresses in the keys are not reused
+        std::unordered_set<std::shared_ptr<const SourceMap>> source_maps;
+        std::unique_ptr<Sample[]> ring;
+        std::atomic<Sample*> active_ring{nullptr};
+        std::atomic<uint64_t> written{0};
+        uint64_t read = 0;
+        uint64_t dropped = 0;
+        uint64_t samples = 0;
+        std::unordered_map<std::string, uint64_t> stacks;
+#if BEHAVIOR_TREE_LITE_POSIX
+        struct sigaction previous_action;
+#endif
+    };
+
+    /// Checked by every tick, so it is kept apart from the state
+    static inline std::atomic<bool> sampling{false};
+
+    static State& state() {
+        static State instance;
+        return instance;
+    }
+
+#if BEHAVIOR_TREE_LITE_POSIX
+    static void handle(int) {
+        auto saved_errno = errno;
+        auto& st = state();
+        auto ring = st.active_ring.load(std::memory_order_acquire);
+        if (ring) {
+            auto n = st.written.fetch_add(1, std::memory_order_relaxed);
+            auto& sample = ring[n % ring_size];
+            sample.sequence.store(0, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            auto depth = std::min(node_path.depth, NodePath::max_depth);
+            for (uint32_t i = 0; i < depth; i++) {
+                sample.ids[i].store(node_path.ids[i], std::memory_order_relaxed);
+            }
+            sample.depth.store(depth, std::memory_order_relaxed);
+            sample.sequence.store(n + 1, std::memory_order_release);
+        }
+        errno = saved_errno;
+    }
+#endif
+
+public:
+    /// Whether the profiler is sampling.
+    static bool active() {
+        return sampling.load(std::memory_order_relaxed);
+    }
+
+    /// Returns the id of the label of a node, `name@file:line`.
+    static uint32_t intern(const std::string& name, const std::shared_ptr<const SourceMap>& source_map, size_t offset) {
+        auto& st = state();
+        auto key = name;
+        key += '\0';
+        key += std::to_string(reinterpret_cast<uintptr_t>(source_map.get()));
+        key += '\0';
+        key += std::to_string(offset);
+        std::lock_guard<std::mutex> lock(st.mutex);
+        auto it = st.label_ids.find(key);
+        if (it != st.label_ids.end()) return it->second;
+        auto label = name;
+        if (source_map) {
+            auto loc = source_map->locate(offset);
+            label += '@';
+            if (!loc.file.empty()) {
+                label += loc.file;
+                label += ':';
+            }
+            label += std::to_string(loc.line);
+            st.source_maps.insert(source_map);
+        }
+        // The separators of the folded format
+        std::replace(label.begin(), label.end(), ';', ':');
+        std::replace(label.begin(), label.end(), '\n', ' ');
+        auto id = static_cast<uint32_t>(st.labels.size());
+        st.labels.push_back(std::move(label));
+        st.label_ids.emplace(std::move(key), id);
+        return id;
+    }
+
+    /// Starts sampling `hz` times per second of CPU time. Returns false if it is
+    /// already sampling or not supported, including when `BEHAVIOR_TREE_LITE_PROFILER`
+    /// is not defined.
+    static bool start(int hz = 99) {
+#if BEHAVIOR_TREE_LITE_POSIX && BEHAVIOR_TREE_LITE_PROFILER
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        if (st.active_ring.load() || hz <= 0) return false;
+        if (!st.ring) st.ring.reset(new Sample[ring_size]);
+        st.active_ring.store(st.ring.get(), std::memory_order_release);
+        sampling.store(true, std::memory_order_relaxed);
+        struct sigaction action = {};
+        action.sa_handler = handle;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &st.previous_action);
+        itimerval timer = {};
+        timer.it_interval.tv_sec = 0;
+        timer.it_interval.tv_usec = std::max(1, 1000000 / hz);
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        return true;
+#else
+        (void)hz;
+        return false;
+#endif
+    }
+
+    /// Stops sampling and collects the remaining samples.
+    static void stop() {
+#if BEHAVIOR_TREE_LITE_POSIX
+        auto& st = state();
+        {
+            std::lock_guard<std::mutex> lock(st.mutex);
+            if (!st.active_ring.load()) return;
+            itimerval timer = {};
+            setitimer(ITIMER_PROF, &timer, nullptr);
+            // A signal may still be pending, so the handler stays installed and only
+            // stops recording.
+            st.active_ring.store(nullptr, std::memory_order_release);
+            sampling.store(false, std::memory_order_relaxed);
+        }
+        collect();
+#endif
+    }
+
+    /// Aggregates the samples taken since the last call.
+    static void collect() {
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        if (!st.ring) return;
+        auto written = st.written.load(std::memory_order_acquire);
+        if (written - st.read > ring_size) {
+            st.dropped += written - st.read - ring_size;
+            st.read = written - ring_size;
+        }
+        std::string key;
+        for (; st.read < written; st.read++) {
+            auto& sample = st.ring[st.read % ring_size];
+            if (sample.sequence.load(std::memory_order_acquire) != st.read + 1) {
+                st.dropped++;
+                continue;
+            }
+            auto depth = sample.depth.load(std::memory_order_relaxed);
+            key.clear();
+            for (uint32_t i = 0; i < depth; i++) {
+                auto id = sample.ids[i].load(std::memory_order_relaxed);
+                key.append(reinterpret_cast<const char*>(&id), sizeof id);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sample.sequence.load(std::memory_order_relaxed) != st.read + 1) {
+                st.dropped++;
+                continue;
+            }
+            st.samples++;
+            if (depth) st.stacks[key]++;
+        }
+    }
+
+    /// Writes the collected stacks in the folded format, a line per stack of the
+    /// labels from the root separated by `;`, followed by the number of samples.
+    static void write_folded(std::ostream& os) {
+        collect();
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        std::string line;
+        for (auto& [key, count] : st.stacks) {
+            line.clear();
+            for (size_t i = 0; i < key.size(); i += sizeof(uint32_t)) {
+                uint32_t id;
+                std::memcpy(&id, key.data() + i, sizeof id);
+                if (i) line += ';';
+                line += id < st.labels.size() ? st.labels[id] : "?";
+            }
+            os << line << ' ' << count << '\n';
+        }
+    }
+
+    /// The number of samples collected, including those outside any tree
+    static uint64_t samples() {
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        return st.samples;
+    }
+
+    /// The number of samples lost because `collect()` was not called often enough
+    static uint64_t dropped() {
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        return st.dropped;
+    }
+
+    /// Forgets the collected samples.
+    static void reset() {
+        collect();
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+        st.stacks.clear();
+        st.samples = 0;
+        st.dropped = 0;
+    }
+};
+
+/// The result of a tick of a condition node shared by identical nodes of a tree.
+struct CachedResult {
+    uint64_t generation = 0;
+    uint64_t writes = 0;
+    BehaviorResult result = BehaviorResult::Fail;
+};
+
+struct BehaviorNodeContainer {
+    /// Name of the type of the node
+    std::string name;
+    /// Where the node is defined, resolved by `location()`
+    size_t source_offset = 0;
+    std::shared_ptr<const SourceMap> source_map;
+    /// The result shared with the identical condition nodes in the same tree, see `Program`
+    std::shared_ptr<CachedResult> cached;
+    /// The result of the last tick, or nullopt if it was never ticked or was halted
+    std::optional<BehaviorResult> last_result;
+    /// The id of the label of the node in `SamplingProfiler`, or 0 until it is
+    /// ticked while the profiler is active
+    uint32_t profile_id = 0;
+protected:
+    std::unique_ptr<BehaviorNode> node;
+    BBMap blackboard_map;
+    std::vector<BehaviorNodeContainer> child_nodes;
+
+public:
+    BehaviorNodeContainer(
+        std::string name,
+        std::unique_ptr<BehaviorNode> node,
+        BBMap bbmap,
+        std::vector<BehaviorNodeContainer> child_nodes
+    ) : name(name),
+        node(std::move(node)),
+        blackboard_map(std::move(bbmap)),
+        child_nodes(std::move(child_nodes)) { }
+
+    BehaviorResult tick(Context& context) {
+#if BEHAVIOR_TREE_LITE_PROFILER
+        if (SamplingProfiler::active()) {
+            return tick_profiled(context);
+        }
+#endif
+        return tick_unprofiled(context);
+    }
+
+    /// The score of the node if it is a `ScorerNode`.
+    std::optional<double> score(Context& context) {
+        auto scorer = dynamic_cast<ScorerNode*>(this->node.get());
+        if (!scorer) return std::nullopt;
+        return in_scope(context, [&]() { return scorer->score(context); });
+    }
+
+    /// Resets the node and its descendants, abandoning a Running execution.
+    void halt() {
+        last_result.reset();
+        if (node) node->halt();
+        for (auto& child : child_nodes) {
+            child.halt();
+        }
+    }
+
+    const std::vector<BehaviorNodeContainer>& get_child_nodes() const {
+        return child_nodes;
+    }
+
+    const BehaviorNode* get_node() const {
+        return node.get();
+    }
+
+    /// The location of the node in the source text, if it is known.
+    std::optional<SourceLocation> location() const {
+        if (!source_map) return std::nullopt;
+        return source_map->locate(source_offset);
+    }
+
+private:
+    BehaviorResult tick_unprofiled(Context& context) {
+        if (this->node) {
+            if (cached && context.generation) {
+                if (cached->generation == context.generation && cached->writes == context.writes) {
+                    last_result = cached->result;
+                    return cached->result;
+                }
+                auto res = in_scope(context, [&]() { return this->node->tick(context); });
+                if (res != BehaviorResult::Running) {
+                    *cached = CachedResult{ context.generation, context.writes, res };
+                }
+                last_result = res;
+                return res;
+            }
+            auto res = in_scope(context, [&]() { return this->node->tick(context); });
+            last_result = res;
+            return res;
+        }
+        last_result = BehaviorResult::Success;
+        return BehaviorResult::Success;
+    }
+
+    /// Ticks the node with it pushed to `node_path`. It is decided once per node, so
+    /// that the pushes and the pops match if the profiler starts or stops meanwhile.
+    BehaviorResult tick_profiled(Context& context) {
+        if (!profile_id) profile_id = SamplingProfiler::intern(name, source_map, source_offset);
+        NodePathScope path(profile_id);
+        return tick_unprofiled(context);
+    }
+
+    /// Calls `f` with the context pointing to the ports and the children of this node.
+    template<typename F>
+    std::invoke_result_t<F> in_scope(Context& context, F f) {
+        auto prev_child_node = context.child_nodes;
+        context.child_nodes = &this->child_nodes;
+        auto prev_blackboard_map = context.blackboard_map;
+        context.blackboard_map = &this->blackboard_map;
+        try {
+            auto res = f();
+            context.child_nodes = prev_child_node;
+            context.blackboard_map = prev_blackboard_map;
+            return res;
+        }
+        catch (std::exception &e) {
+            context.child_nodes = prev_child_node;
+            context.blackboard_map = prev_blackboard_map;
+            throw;
+        }
+    }
+};
+
+inline std::optional<BehaviorResult> Context::tick_child(int idx) {
+    auto children = this->child_nodes;
+    if (children->size() <= idx) return std::nullopt;
+    auto& child = (*children)[idx];
+    return child.tick(*this);
+}
+
+class SequenceNode : public BehaviorNode {
+    int current_child = 0;
+    BehaviorResult tick(Context& context) override {
+        BehaviorResult result = BehaviorResult::Success;
+        while (current_child < context.child_nodes->size()) {
+            result = (*context.child_nodes)[current_child].tick(context);
+            bool break_out = false;
+            switch (result) {
+                case BehaviorResult::Success: current_child++; break;
+                case BehaviorResult::Fail: break_out = true; break;
+                case BehaviorResult::Running: break_out = true; break;
+            }
+            if (break_out) break;
+        }
+        // Only a Running child is resumed in the next tick
+        if (result != BehaviorResult::Running) {
+            current_child = 0;
+        }
+
+        return result;
+    }
+
+    void halt() override {
+        current_child = 0;
+    }
+
+    std::string state() const override {
+        return "current_child=" + std::to_string(current_child);
+    }
+};
+
+/// Halts the child that was Running in the last tick if a reactive node did not
+/// reach it in this tick, because an earlier child took over.
+inline void halt_preempted(Context& context, int& running_child, int last_ticked, BehaviorResult result) {
+    if (running_child > last_ticked && running_child < static_cast<int>(context.child_nodes->size())) {
+        (*context.child_nodes)[running_child].halt();
+    }
+    running_child = result == BehaviorResult::Running ? last_ticked : -1;
+}
+
+class ReactiveSequenceNode : public BehaviorNode {
+    int running_child = -1;
+    BehaviorResult tick(Context& context) override {
+        int current_child = 0;
+        int last_ticked = -1;
+        BehaviorResult result = BehaviorResult::Success;
+        while (current_child < context.child_nodes->size()) {
+            last_ticked = current_child;
+            result = (*context.child_nodes)[current_child].tick(context);
+            bool break_out = false;
+            switch (result) {
+                case BehaviorResult::Success: current_child++; break;
+                case BehaviorResult::Fail: current_child++; break_out = true; break;
+                case BehaviorResult::Running: break_out = true; break;
+            }
+            if (break_out) break;
+        }
+        halt_preempted(context, running_child, last_ticked, result);
+
+        return result;
+    }
+
+    void halt() override {
+        running_child = -1;
+    }
+
+    std::string state() const override {
+        return "running_child=" + std::to_string(running_child);
+    }
+};
+
+class FallbackNode : public BehaviorNode {
+    int current_child = 0;
+    BehaviorResult tick(Context& context) override {
+        BehaviorResult result = BehaviorResult::Fail;
+        while (current_child < context.child_nodes->size()) {
+            result = (*context.child_nodes)[current_child].tick(context);
+            bool break_out = false;
+            switch (result) {
+                case BehaviorResult::Success: break_out = true; break;
+                case BehaviorResult::Fail: current_child++; break;
+                case BehaviorResult::Running: break_out = true; break;
+            }
+            if (break_out) break;
+        }
+        // Only a Running child is resumed in the next tick
+        if (result != BehaviorResult::Running) {
+            current_child = 0;
+        }
+
+        return result;
+    }
+
+    void halt() override {
+        current_child = 0;
+    }
+
+    std::string state() const override {
+        return "current_child=" + std::to_string(current_child);
+    }
+};
+
+class ReactiveFallbackNode : public BehaviorNode {
+    int running_child = -1;
+    BehaviorResult tick(Context& context) override {
+        BehaviorResult result = BehaviorResult::Fail;
+        int current_child = 0;
+        int last_ticked = -1;
+        while (current_child < context.child_nodes->size()) {
+            last_ticked = current_child;
+            result = (*context.child_nodes)[current_child].tick(context);
+            bool break_out = false;
+            switch (result) {
+                case BehaviorResult::Success: current_child++; break_out = true; break;
+                case BehaviorResult::Fail: current_child++; break;
+                case BehaviorResult::Running: break_out = true; break;
+            }
+            if (break_out) {
+                current_child++;
+                break;
+            }
+        }
+        halt_preempted(context, running_child, last_ticked, result);
+
+        return result;
+    }
+
+    void halt() override {
+        running_child = -1;
+    }
+
+    std::string state() const override {
+        return "running_child=" + std::to_string(running_child);
+    }
+};
+
+class ForceSuccessNode : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        auto first = context.child_nodes->begin();
+        if (first != context.child_nodes->end()) {
+            auto result = first->tick(context);
+            switch (result) {
+                case BehaviorResult::Running: return BehaviorResult::Running;
+            }
+        }
+
+        return BehaviorResult::Success;
+    }
+};
+
+class ForceFailureNode : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        auto first = context.child_nodes->begin();
+        if (first != context.child_nodes->end()) {
+            auto result = first->tick(context);
+            switch (result) {
+                case BehaviorResult::Running: return BehaviorResult::Running;
+            }
+        }
+
+        return BehaviorResult::Fail;
+    }
+};
+
+class InverterNode : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        BehaviorResult result = BehaviorResult::Fail;
+        const auto child = context.child_nodes->begin();
+        if (child != context.child_nodes->end()) {
+            result = child->tick(context);
+            switch (result) {
+                case BehaviorResult::Success: result = BehaviorResult::Fail; break;
+                case BehaviorResult::Fail: result = BehaviorResult::Success; break;
+            }
+        }
+
+        return result;
+    }
+};
+
+class RepeatNode : public BehaviorNode {
+    int n = 0;
+    BehaviorResult tick(Context& ctx) override {
+        BehaviorResult result = BehaviorResult::Fail;
+        auto n = ctx.get("n");
+        if (!n) throw invalid_count_error();
+        if (this->n == 0) this->n = std::atoi(n->c_str());
+        if (!this->n) {
+            throw invalid_count_error();
+        }
+        this->n--;
+        if (this->n == 0) {
+            return BehaviorResult::Success;
+        }
+        auto res = ctx.tick_child(0);
+        if (!res) return BehaviorResult::Fail;
+        if (res == BehaviorResult::Success) {
+            return BehaviorResult::Running;
+        }
+        else if (res == BehaviorResult::Running) {
+            return BehaviorResult::Running;
+        }
+        this->n = 0;
+        return *res;
+    }
+
+    void halt() override {
+        n = 0;
+    }
+
+    std::string state() const override {
+        return "n=" + std::to_string(n);
+    }
+};
+
+class RetryNode : public BehaviorNode {
+    int n = 0;
+    BehaviorResult tick(Context& ctx) override {
+        BehaviorResult result = BehaviorResult::Fail;
+        auto n = ctx.get("n");
+        if (!n) throw invalid_count_error();
+        if (this->n == 0) this->n = std::atoi(n->c_str());
+        if (!this->n) {
+            throw invalid_count_error();
+        }
+        this->n--;
+        if (this->n == 0) {
+            return BehaviorResult::Success;
+        }
+        auto res = ctx.tick_child(0);
+        if (!res) return BehaviorResult::Fail;
+        if (res == BehaviorResult::Fail) {
+            return BehaviorResult::Running;
+        }
+        else if (res == BehaviorResult::Running) {
+            return BehaviorResult::Running;
+        }
+        this->n = 0;
+        return *res;
+    }
+
+    void halt() override {
+        n = 0;
+    }
+
+    std::string state() const override {
+        return "n=" + std::to_string(n);
+    }
+};
+
+class TrueNode : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        return BehaviorResult::Success;
+    }
+};
+
+class FalseNode : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        return BehaviorResult::Fail;
+    }
+};
+
+class SetBoolNode : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        auto var_it = context.get("value");
+        if (var_it) {
+            context.set("output", *var_it);
+        }
+
+        return BehaviorResult::Success;
+    }
+};
+
+class IfNode : public BehaviorNode {
+    /// The branch that returned Running in the last tick, or 0
+    int running_branch = 0;
+    BehaviorResult tick(Context& ctx) override {
+        auto res = ctx.tick_child(0);
+        int branch = res == BehaviorResult::Fail ? 2 : 1;
+        if (running_branch && running_branch != branch) {
+            (*ctx.child_nodes)[running_branch].halt();
+        }
+        auto res2 = ctx.tick_child(branch);
+        auto result = res2 ? *res2 : BehaviorResult::Fail;
+        running_branch = result == BehaviorResult::Running ? branch : 0;
+        return result;
+    }
+
+    void halt() override {
+        running_branch = 0;
+    }
+
+    std::string state() const override {
+        return "running_branch=" + std::to_string(running_branch);
+    }
+};
+
+/// A part of a tree made of Sequence, Fallback, Inverter, ForceSuccess, ForceFailure
+/// and `if` nodes, compiled to a state machine over its other nodes, the leaves.
+///
+/// The nodes only keep a state while a leaf is Running, so the state of the machine
+/// is the Running leaf to resume, and what follows a leaf returning a result is known
+/// in advance. See `lower_fsm()`.
+struct FsmTable {
+    /// What a tick does next: ticks the leaf, or ends with the result if `leaf` is -1
+    struct Step {
+        int leaf = -1;
+        BehaviorResult result = BehaviorResult::Fail;
+    };
+
+    /// An `if` above a Running leaf, whose condition is ticked again before the leaf
+    /// is resumed, like `IfNode` does
+    struct Guard {
+        /// The leaf of the condition
+        size_t condition;
+        /// The branch with the Running leaf, 1 or 2
+        int branch;
+        /// Entering the then and the else branches afresh
+        Step enter[2];
+        /// The leaves in the branch with the Running leaf, halted if the other one is taken
+        std::vector<size_t> halt;
+    };
+
+    Step start;
+    /// The step after each leaf returns each result, at `leaf * 3 + result`
+    std::vector<Step> transitions;
+    /// The guards of each leaf, outermost first
+    std::vector<std::vector<Guard>> guards;
+};
+
+/// Ticks the leaves of a `FsmTable`, which are its children.
+class FsmNode : public BehaviorNode {
+    std::shared_ptr<const FsmTable> table;
+    /// The Running leaf, or -1
+    int resume = -1;
+
+public:
+    explicit FsmNode(std::shared_ptr<const FsmTable> table) : table(std::move(table)) {}
+
+    BehaviorResult tick(Context& context) override {
+        auto& leaves = *context.child_nodes;
+        auto step = table->start;
+        if (resume >= 0) {
+            step = FsmTable::Step{ resume };
+            for (auto& guard : table->guards[resume]) {
+                auto res = leaves[guard.condition].tick(context);
+                int branch = res == BehaviorResult::Fail ? 2 : 1;
+                if (branch != guard.branch) {
+                    for (auto leaf : guard.halt) {
+                        leaves[leaf].halt();
+                    }
+                    step = guard.enter[branch - 1];
+                    break;
+                }
+            }
+        }
+        int last = -1;
+        while (step.leaf >= 0) {
+            last = step.leaf;
+            auto res = leaves[step.leaf].tick(context);
+            step = table->transitions[step.leaf * 3 + static_cast<int>(res)];
+        }
+        resume = step.result == BehaviorResult::Running ? last : -1;
+        return step.result;
+    }
+
+    void halt() override {
+        resume = -1;
+    }
+
+    std::string state() const override {
+        return "resume=" + std::to_string(resume);
+    }
+};
+
+/// Evaluates the expression in the `expr` port, such as `hp < 10 && ammo > 0`,
+/// against the variables of the current scope. See `Expression`. A literal
+/// expression is parsed once, and one in a variable whenever its text changes.
+///
+/// The variables of a literal expression that are bound to fields, see
+/// `Registry::bind_field()`, are compiled to input ports named after them, through
+/// which the fields are read. An expression in a variable does not see the fields.
+///
+/// If the executor evaluates the conditions in batches, the result for the agent
+/// is taken from the bitmask computed for all agents at the start of the frame.
+class ConditionNode : public BehaviorNode {
+    std::optional<Expression> expression;
+    BehaviorResult tick(Context& ctx) override {
+        auto port = ctx.port("expr");
+        if (!port) throw undefined_port_error();
+        if (!expression || !std::holds_alternative<std::string>(*port)) {
+            auto text = ctx.read(*port);
+            if (!text) throw undefined_port_error();
+            if (!expression || expression->text != *text) {
+                auto res = Expression::parse(*text);
+                if (auto e = std::get_if<1>(&res)) throw parse_error(*e);
+                expression = std::move(std::get<0>(res));
+            }
+        }
+        if (auto result = batched_result(ctx, *expression)) {
+            return *result;
+        }
+        auto lookup = [&ctx](const std::string& name) {
+            return lookup_number(ctx, name);
+        };
+        return expression->evaluate(lookup) ? BehaviorResult::Success : BehaviorResult::Fail;
+    }
+
+public:
+    /// The value of a variable in an expression: the field it is bound to, the column
+    /// of the agent, the blackboard variable, or NaN if none of them exists.
+    static double lookup_number(Context& ctx, const std::string& name) {
+        if (reads_fields(ctx)) {
+            if (auto port = ctx.port(name); port && std::holds_alternative<FieldPort>(*port)) {
+                auto value = ctx.read_number(*port);
+                return value ? *value : std::nan("");
+            }
+        }
+        if (auto column = ctx.columns ? ctx.columns->find(name) : nullptr) {
+            return column[ctx.row];
+        }
+        auto it = ctx.blackboard.find(name);
+        if (it == ctx.blackboard.end()) return std::nan("");
+        return parse_number(it->second);
+    }
+
+    /// The result computed for the agent at the start of the frame, if the executor
+    /// evaluates the conditions in batches.
+    static std::optional<BehaviorResult> batched_result(Context& ctx, const Expression& expression) {
+        if (ctx.batch && ctx.columns && !reads_fields(ctx)) {
+            auto& condition = ctx.batch->find_or_add(expression);
+            if (condition.valid && ctx.row < condition.mask.size) {
+                return condition.mask.test(ctx.row) ? BehaviorResult::Success : BehaviorResult::Fail;
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    /// Whether the node has the ports of bound variables besides `expr`
+    static bool reads_fields(const Context& ctx) {
+        return ctx.blackboard_map->size() > 1;
+    }
+};
+
+/// The base of the `Condition` nodes generated by `generate_native()`, which
+/// evaluate the expression as compiled code instead of walking `Expression`.
+class NativeCondition : public BehaviorNode {
+    Expression expression;
+
+protected:
+    static double lookup_number(Context& ctx, const std::string& name) {
+        return ConditionNode::lookup_number(ctx, name);
+    }
+
+    virtual bool evaluate(Context& ctx) = 0;
+
+public:
+    /// The expression is still parsed, to find the batched result.
+    explicit NativeCondition(std::string_view text) :
+        expression(std::get<Expression>(Expression::parse(text))) {}
+
+    BehaviorResult tick(Context& ctx) override {
+        if (auto result = ConditionNode::batched_result(ctx, expression)) {
+            return *result;
+        }
+        return evaluate(ctx) ? BehaviorResult::Success : BehaviorResult::Fail;
+    }
+};
+
+/// Succeeds if the `input` port is true or a non-zero number. A condition of
+/// `if` naming a variable instead of a node, as in `if (has_target) { ... }`,
+/// is compiled to this node.
+class IsTrueNode : public BehaviorNode {
+    BehaviorResult tick(Context& ctx) override {
+        auto value = ctx.get_number("input");
+        return value && *value != 0. && !std::isnan(*value) ? BehaviorResult::Success : BehaviorResult::Fail;
+    }
+};
+
+inline int count_trailing_zeros(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/// A ReactiveFallbackStar whose children are all `if (var) { ... }` without `else`.
+/// The children of this node are the bodies of the `if`s, and the guards are read
+/// into a bitmask at every tick, so the first branch to run is found by counting
+/// trailing zeros instead of ticking every `if` in turn.
+///
+/// A branch that fails is cleared from the mask and the next one is tried, as the
+/// interpreted fallback would. The branch Running in the last tick is halted if
+/// another branch takes over.
+class BitmaskFallbackNode : public BehaviorNode {
+    std::vector<BlackboardValue> guards;
+    int running_child = -1;
+public:
+    static constexpr size_t max_guards = 64;
+
+    explicit BitmaskFallbackNode(std::vector<BlackboardValue> guards) : guards(std::move(guards)) {}
+
+    BehaviorResult tick(Context& ctx) override {
+        uint64_t mask = 0;
+        for (size_t i = 0; i < guards.size(); i++) {
+            auto value = ctx.read_number(guards[i]);
+            if (value && *value != 0. && !std::isnan(*value)) {
+                mask |= uint64_t(1) << i;
+            }
+        }
+
+        // The branch Running in the last tick, until it is ticked again or halted.
+        // It is halted in the same order as the `if` would do when its guard is false.
+        int pending = running_child;
+        auto result = BehaviorResult::Fail;
+        int winner = -1;
+        while (mask) {
+            auto i = count_trailing_zeros(mask);
+            if (pending >= 0 && pending < i) {
+                (*ctx.child_nodes)[pending].halt();
+            }
+            if (pending <= i) pending = -1;
+            result = (*ctx.child_nodes)[i].tick(ctx);
+            if (result != BehaviorResult::Fail) {
+                winner = i;
+                break;
+            }
+            mask &= mask - 1;
+        }
+
+        if (pending >= 0) {
+            (*ctx.child_nodes)[pending].halt();
+        }
+        running_child = result == BehaviorResult::Running ? winner : -1;
+        return result;
+    }
+
+    void halt() override {
+        running_child = -1;
+    }
+
+    std::string state() const override {
+        return "running_child=" + std::to_string(running_child);
+    }
+};
+
+/// The rules of a decision table, compiled to the set of rows matching each value
+/// of each column. Finding the first matching row takes an AND of one bitset per
+/// column, regardless of the number of rows.
+struct DecisionTable {
+    struct Column {
+        BlackboardValue variable;
+        /// Whether all the patterns are true or false, in which case the variable
+        /// is compared by its truthiness
+        bool boolean = true;
+        /// Index of each value in the patterns
+        std::unordered_map<std::string, size_t> values;
+        /// Rows matching each of `values`, then rows matching any other or missing value
+        std::vector<Bitmask> rows;
+    };
+    size_t row_count = 0;
+    std::vector<Column> columns;
+
+    /// Compiles the ports of a "DecisionTable" node, see `decision_table()`.
+    static DecisionTable compile(const BBMap& ports, size_t row_count) {
+        DecisionTable ret;
+        ret.row_count = row_count;
+        for (size_t j = 0;; j++) {
+            auto variable = ports.find("c" + std::to_string(j));
+            if (variable == ports.end()) break;
+            Column column;
+            column.variable = variable->second;
+            Bitmask wildcard(row_count), any_negated(row_count);
+            std::vector<Bitmask> equal, negated;
+            for (size_t i = 0; i < row_count; i++) {
+                auto cell = ports.find("r" + std::to_string(i) + "_" + std::to_string(j));
+                auto pattern = cell != ports.end() ? std::get_if<std::string>(&cell->second) : nullptr;
+                if (!pattern || pattern->empty()) {
+                    wildcard.set(i);
+                    continue;
+                }
+                auto value = pattern->substr(1);
+                if (value != "true" && value != "false") column.boolean = false;
+                auto [it, inserted] = column.values.emplace(value, equal.size());
+                if (inserted) {
+                    equal.emplace_back(row_count);
+                    negated.emplace_back(row_count);
+                }
+                if ((*pattern)[0] == '!') {
+                    negated[it->second].set(i);
+                    any_negated.set(i);
+                }
+                else {
+                    equal[it->second].set(i);
+                }
+            }
+            for (size_t k = 0; k < equal.size(); k++) {
+                Bitmask rows(row_count);
+                for (size_t w = 0; w < rows.words.size(); w++) {
+                    rows.words[w] = wildcard.words[w] | equal[k].words[w] | (any_negated.words[w] & ~negated[k].words[w]);
+                }
+                column.rows.push_back(std::move(rows));
+            }
+            Bitmask other(row_count);
+            for (size_t w = 0; w < other.words.size(); w++) {
+                other.words[w] = wildcard.words[w] | any_negated.words[w];
+            }
+            column.rows.push_back(std::move(other));
+            ret.columns.push_back(std::move(column));
+        }
+        return ret;
+    }
+
+    /// Returns the first row matching the variables in the context.
+    /// `scratch` is a buffer reused across calls.
+    std::optional<size_t> match(const Context& ctx, std::vector<uint64_t>& scratch) const {
+        scratch.assign((row_count + 63) / 64, ~uint64_t(0));
+        for (auto& column : columns) {
+            auto k = column.values.size();
+            if (column.boolean) {
+                if (auto value = ctx.read_number(column.variable)) {
+                    auto it = column.values.find(*value != 0. && !std::isnan(*value) ? "true" : "false");
+                    if (it != column.values.end()) k = it->second;
+                }
+            }
+            else if (auto value = ctx.read(column.variable)) {
+                auto it = column.values.find(*value);
+                if (it != column.values.end()) k = it->second;
+            }
+            uint64_t any = 0;
+            for (size_t w = 0; w < scratch.size(); w++) {
+                scratch[w] &= column.rows[k].words[w];
+                any |= scratch[w];
+            }
+            if (!any) return std::nullopt;
+        }
+        for (size_t w = 0; w < scratch.size(); w++) {
+            auto bits = w + 1 == scratch.size() && row_count % 64
+                ? scratch[w] & ((uint64_t(1) << (row_count % 64)) - 1) : scratch[w];
+            if (bits) return w * 64 + count_trailing_zeros(bits);
+        }
+        return std::nullopt;
+    }
+};
+
+/// Ticks the action of the first row of a decision table matching the variables,
+/// and fails if no row matches. The table is checked again at every tick, and the
+/// action Running in the last tick is halted if another row is selected.
+class DecisionTableNode : public BehaviorNode {
+    std::shared_ptr<const DecisionTable> table;
+    std::vector<uint64_t> scratch;
+    int running_row = -1;
+public:
+    explicit DecisionTableNode(std::shared_ptr<const DecisionTable> table) : table(std::move(table)) {}
+
+    BehaviorResult tick(Context& ctx) override {
+        auto row = table->match(ctx, scratch);
+        int selected = row ? static_cast<int>(*row) : -1;
+        if (running_row >= 0 && running_row != selected) {
+            (*ctx.child_nodes)[running_row].halt();
+        }
+        auto result = BehaviorResult::Fail;
+        if (row) {
+            if (auto res = ctx.tick_child(selected)) result = *res;
+        }
+        running_row = result == BehaviorResult::Running ? selected : -1;
+        return result;
+    }
+
+    void halt() override {
+        running_row = -1;
+    }
+
+    std::string state() const override {
+        return "running_row=" + std::to_string(running_row);
+    }
+};
+
+/// Ticks the child with the highest score. The score of child i is the port
+/// `score<i>`, a variable or a literal number, or the score of the child itself if
+/// it is a `ScorerNode`. A child without a score is never selected, and the node
+/// fails if no child has a score.
+///
+/// The selected child is kept until another one scores higher by more than the
+/// `hysteresis` port, 0 by default, so that close scores do not make it flap.
+///
+/// If the executor evaluates the node inputs in batches and all the scores are
+/// columns or literals, the highest score is taken from the batch.
+class UtilitySelectorNode : public BehaviorNode {
+    /// The ports of the scores, resolved at the first tick
+    std::vector<const BlackboardValue*> scores;
+    bool resolved = false;
+    /// Identifies the scores in `BatchConditions`, if they can be evaluated in batches
+    std::string batch_key;
+    BatchConditions::Selection selection;
+    int current = -1;
+    bool running = false;
+
+    void resolve(Context& ctx) {
+        resolved = true;
+        bool batchable = true;
+        for (size_t i = 0; i < ctx.child_nodes->size(); i++) {
+            auto port = ctx.port("score" + std::to_string(i));
+            scores.push_back(port);
+            if (auto x = port ? std::get_if<0>(port) : nullptr) {
+                selection.scores.push_back(x->first);
+                selection.constants.push_back(0.);
+                batch_key += x->first + ",";
+            }
+            else if (auto x = port ? std::get_if<1>(port) : nullptr) {
+                selection.scores.push_back("");
+                selection.constants.push_back(parse_number(*x));
+                batch_key += "=" + *x + ",";
+            }
+            else {
+                batchable = false;
+            }
+        }
+        if (!batchable) batch_key.clear();
+    }
+
+    double score(Context& ctx, size_t i) {
+        std::optional<double> ret;
+        if (scores[i]) ret = ctx.read_number(*scores[i]);
+        else ret = (*ctx.child_nodes)[i].score(ctx);
+        return ret ? *ret : std::nan("");
+    }
+
+public:
+    BehaviorResult tick(Context& ctx) override {
+        if (!resolved) resolve(ctx);
+
+        int best = -1;
+        double best_score = -INFINITY;
+        const BatchConditions::Selection* batch = nullptr;
+        if (ctx.batch && ctx.columns && !batch_key.empty()) {
+            batch = &ctx.batch->find_or_add(batch_key, selection);
+            if (!batch->valid || ctx.row >= batch->best.size()) batch = nullptr;
+        }
+        if (batch) {
+            best = batch->best[ctx.row];
+            best_score = score(ctx, best);
+            if (std::isnan(best_score)) best = -1;
+        }
+        else {
+            for (size_t i = 0; i < scores.size(); i++) {
+                auto s = score(ctx, i);
+                if (s > best_score) {
+                    best = static_cast<int>(i);
+                    best_score = s;
+                }
+            }
+        }
+
+        if (best >= 0 && current >= 0 && best != current) {
+            auto hysteresis = ctx.get_number("hysteresis");
+            auto current_score = score(ctx, current);
+            // A child that lost its score is not kept
+            if (!std::isnan(current_score) && !(best_score > current_score + (hysteresis ? *hysteresis : 0.))) {
+                best = current;
+            }
+        }
+
+        if (running && current != best) {
+            (*ctx.child_nodes)[current].halt();
+        }
+        current = best;
+        auto result = BehaviorResult::Fail;
+        if (best >= 0) {
+            if (auto res = ctx.tick_child(best)) result = *res;
+        }
+        running = result == BehaviorResult::Running;
+        return result;
+    }
+
+    void halt() override {
+        current = -1;
+        running = false;
+    }
+
+    std::string state() const override {
+        return "current=" + std::to_string(current) + " running=" + (running ? "true" : "false");
+    }
+};
+
+/// A Fallback over pure children, see `Registry::pure_node_types`, which learns the
+/// order to tick them in. Since the children have no side effects, the order only
+/// changes how much the fallback costs, not what it does.
+///
+/// It is reactive: every tick starts again from the first child in the order, and
+/// a child that was Running is halted if a child before it succeeds or runs.
+///
+/// It records how often each child succeeds and, in one of `timing_interval` ticks,
+/// how long its tick takes. Every `period` ticks (100 by default) it sorts the
+/// children by the expected cost per success, cost / P(success). Children whose
+/// time was never measured go first, so that they get measured.
+///
+/// The `order` port, such as "2,0,1", freezes the order instead. So does a profile
+/// file given by the `profile` port, see `AdaptiveProfile`.
+class AdaptiveFallbackNode : public BehaviorNode {
+public:
+    struct Statistics {
+        uint64_t ticks = 0;
+        uint64_t successes = 0;
+        /// The time of the ticks that were timed, and their number
+        uint64_t nanoseconds = 0;
+        uint64_t timed_ticks = 0;
+    };
+
+    /// Reading the clock costs about as much as ticking a simple condition, so only
+    /// one tick of the fallback in this many is timed.
+    static constexpr uint64_t timing_interval = 8;
+
+private:
+    std::string id_;
+    std::vector<size_t> order_;
+    std::vector<Statistics> statistics_;
+    bool frozen = false;
+    bool initialized = false;
+    uint64_t period = 100;
+    uint64_t ticks = 0;
+    int running_child = -1;
+
+    void initialize(Context& ctx) {
+        initialized = true;
+        auto size = ctx.child_nodes->size();
+        statistics_.resize(size);
+        if (auto period = ctx.get_number("period"); period && *period >= 1) {
+            this->period = static_cast<uint64_t>(*period);
+        }
+        if (auto order = ctx.get("order"); order && !frozen) {
+            order_ = parse_order(*order, size);
+            frozen = true;
+        }
+        if (order_.size() != size) {
+            order_.resize(size);
+            for (size_t i = 0; i < size; i++) order_[i] = i;
+        }
+    }
+
+public:
+    AdaptiveFallbackNode() = default;
+
+    /// `order` is frozen if it is given.
+    AdaptiveFallbackNode(std::string id, std::optional<std::vector<size_t>> order) : id_(std::move(id)) {
+        if (order) {
+            order_ = std::move(*order);
+            frozen = true;
+        }
+    }
+
+    BehaviorResult tick(Context& ctx) override {
+        if (!initialized) initialize(ctx);
+
+        auto result = BehaviorResult::Fail;
+        int winner = -1;
+        uint64_t ticked = 0;
+        bool timed = ticks % timing_interval == 0;
+        for (auto i : order_) {
+            auto& child = (*ctx.child_nodes)[i];
+            if (frozen) {
+                result = child.tick(ctx);
+            }
+            else {
+                auto& stats = statistics_[i];
+                if (timed) {
+                    auto start = std::chrono::steady_clock::now();
+                    result = child.tick(ctx);
+                    stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+                    stats.timed_ticks++;
+                }
+                else {
+                    result = child.tick(ctx);
+                }
+                stats.ticks++;
+                if (result == BehaviorResult::Success) stats.successes++;
+            }
+            ticked++;
+            if (result != BehaviorResult::Fail) {
+                winner = static_cast<int>(i);
+                break;
+            }
+        }
+
+        if (running_child >= 0 && running_child != winner) {
+            auto pos = std::find(order_.begin(), order_.end(), size_t(running_child)) - order_.begin();
+            if (static_cast<uint64_t>(pos) >= ticked) (*ctx.child_nodes)[running_child].halt();
+        }
+        running_child = result == BehaviorResult::Running ? winner : -1;
+
+        if (!frozen && ++ticks % period == 0 && running_child < 0) {
+            order_ = best_order(statistics_);
+        }
+        return result;
+    }
+
+    void halt() override {
+        running_child = -1;
+    }
+
+    std::string state() const override {
+        std::string ret = "running_child=" + std::to_string(running_child) + " ticks=" + std::to_string(ticks) + " order=";
+        for (size_t k = 0; k < order_.size(); k++) {
+            ret += (k ? "," : "") + std::to_string(order_[k]);
+        }
+        return ret;
+    }
+
+    /// Identifies the node in a profile: the `id` port, or the source location.
+    const std::string& id() const {
+        return id_;
+    }
+
+    const std::vector<size_t>& order() const {
+        return order_;
+    }
+
+    const std::vector<Statistics>& statistics() const {
+        return statistics_;
+    }
+
+    /// Sorts the children by cost / P(success), with P(success) estimated
+    /// as (successes + 1) / (ticks + 2).
+    static std::vector<size_t> best_order(const std::vector<Statistics>& statistics) {
+        std::vector<double> keys;
+        for (auto& stats : statistics) {
+            auto cost = stats.timed_ticks ? double(stats.nanoseconds) / stats.timed_ticks : 0.;
+            auto p_success = (stats.successes + 1.) / (stats.ticks + 2.);
+            keys.push_back(cost / p_success);
+        }
+        std::vector<size_t> ret(statistics.size());
+        for (size_t i = 0; i < ret.size(); i++) ret[i] = i;
+        std::stable_sort(ret.begin(), ret.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+        return ret;
+    }
+
+    /// Parses an order such as "2,0,1" or "2 0 1", which must be a permutation of
+    /// `size` children.
+    static std::vector<size_t> parse_order(std::string_view text, size_t size) {
+        std::vector<size_t> ret;
+        std::vector<bool> seen(size);
+        size_t i = 0;
+        while (i < text.size()) {
+            if (!isdigit(text[i])) {
+                if (text[i] != ',' && !isspace(text[i])) {
+                    throw parse_error("Invalid order of AdaptiveFallback: " + std::string(text));
+                }
+                i++;
+                continue;
+            }
+            size_t value = 0;
+            while (i < text.size() && isdigit(text[i])) {
+                value = value * 10 + (text[i++] - '0');
+            }
+            if (value >= size || seen[value]) {
+                throw parse_error("Invalid order of AdaptiveFallback: " + std::string(text));
+            }
+            seen[value] = true;
+            ret.push_back(value);
+        }
+        if (ret.size() != size) {
+            throw parse_error("Invalid order of AdaptiveFallback: " + std::string(text));
+        }
+        return ret;
+    }
+};
+
+/// The orders of `AdaptiveFallback` nodes learned in a run, saved to freeze them in
+/// later runs for reproducible results.
+///
+/// Add the trees of the agents with `add()` after they ran for a while and `write()`
+/// the profile. A tree with `AdaptiveFallback(profile <- "file")` then ticks the
+/// children in the order recorded for the node's id, or in the source order if the
+/// id is not in the file or the file does not exist yet. The file has a line per node, the id and the order
+/// separated by a tab.
+class AdaptiveProfile {
+    std::unordered_map<std::string, std::vector<AdaptiveFallbackNode::Statistics>> statistics;
+    std::unordered_map<std::string, std::vector<size_t>> orders;
+    /// Ids in the order they were first seen, to write the file deterministically
+    std::vector<std::string> ids;
+
+public:
+    /// Accumulates the statistics of the `AdaptiveFallback` nodes in the tree.
+    void add(const BehaviorNodeContainer& root) {
+        if (auto node = dynamic_cast<const AdaptiveFallbackNode*>(root.get_node())) {
+            auto [it, inserted] = statistics.try_emplace(node->id(), node->statistics().size());
+            if (inserted) ids.push_back(node->id());
+            auto& sum = it->second;
+            auto& stats = node->statistics();
+            for (size_t i = 0; i < std::min(sum.size(), stats.size()); i++) {
+                sum[i].ticks += stats[i].ticks;
+                sum[i].successes += stats[i].successes;
+                sum[i].nanoseconds += stats[i].nanoseconds;
+                sum[i].timed_ticks += stats[i].timed_ticks;
+            }
+            orders[node->id()] = AdaptiveFallbackNode::best_order(sum);
+        }
+        for (auto& child : root.get_child_nodes()) {
+            add(child);
+        }
+    }
+
+    std::optional<std::vector<size_t>> order(const std::string& id) const {
+        auto it = orders.find(id);
+        if (it == orders.end()) return std::nullopt;
+        return it->second;
+    }
+
+    void write(std::ostream& os) const {
+        for (auto& id : ids) {
+            os << id << '\t';
+            auto& order = orders.at(id);
+            for (size_t i = 0; i < order.size(); i++) {
+                os << (i ? " " : "") << order[i];
+            }
+            os << '\n';
+        }
+    }
+
+    /// Reads a profile file. Throws `parse_error` if it cannot be read.
+    static AdaptiveProfile read(const std::filesystem::path& path) {
+        std::ifstream is(path);
+        if (!is) throw parse_error("Could not read the profile " + path.string());
+        AdaptiveProfile ret;
+        std::string line;
+        while (std::getline(is, line)) {
+            auto tab = line.rfind('\t');
+            if (tab == std::string::npos) continue;
+            auto id = line.substr(0, tab);
+            std::vector<size_t> order;
+            size_t value = 0;
+            bool digits = false;
+            for (auto c : line.substr(tab + 1) + " ") {
+                if (isdigit(c)) {
+                    value = value * 10 + (c - '0');
+                    digits = true;
+                }
+                else if (digits) {
+                    order.push_back(value);
+                    value = 0;
+                    digits = false;
+                }
+            }
+            ret.ids.push_back(id);
+            ret.orders[id] = std::move(order);
+        }
+        return ret;
+    }
+};
+
+struct PortSpec {
+    PortType ty;
+    std::string key;
+
+    static PortSpec new_in(const std::string& key) {
+        return PortSpec {
+            .ty = PortType::Input,
+            .key = key,
+        };
+    }
+
+    static PortSpec new_out(const std::string& key) {
+        return PortSpec {
+            .ty = PortType::Output,
+            .key = key,
+        };
+    }
+
+    static PortSpec new_inout(const std::string& key) {
+        return PortSpec {
+            .ty = PortType::InOut,
+            .key = key,
+        };
+    }
+};
+
+
+/// SubtreeNode is a container for a subtree, introducing a local namescope of blackboard variables.
+struct SubtreeNode : public BehaviorNode {
+    /// Blackboard variables needs to be a part of the node payload
+    Blackboard blackboard;
+    std::vector<PortSpec> params;
+
+    SubtreeNode(Blackboard blackboard, std::vector<PortSpec> params) :
+        blackboard(std::move(blackboard)), params(std::move(params)) {
+    }
+
+    BehaviorResult tick(Context& ctx) override {
+        BehaviorResult res = BehaviorResult::Success;
+        for (auto& param : params) {
+            if (param.ty != PortType::Input && param.ty != PortType::InOut) {
+                continue;
+            }
+            if (auto value = ctx.get(param.key)) {
+                blackboard[param.key] = *value;
+            }
+        }
+
+        // The columns belong to the scope of the root tree
+        auto columns = ctx.columns;
+        ctx.columns = nullptr;
+        std::swap(blackboard, ctx.blackboard);
+        auto sub_res = ctx.tick_child(0);
+        if (sub_res) res = *sub_res;
+        std::swap(blackboard, ctx.blackboard);
+        ctx.columns = columns;
+
+        // It is debatable if we should assign the output value back to the parent blackboard
+        // when the result was Fail or Running. We chose to assign them, which seems less counterintuitive.
+        for (auto& param : params) {
+            if (param.ty != PortType::Output || param.ty != PortType::InOut) {
+                continue;
+            }
+            auto value = blackboard.find(param.key);
+            if (value != blackboard.end()) {
+                ctx.set(param.key, value->second);
+            }
+        }
+
+        return res;
+    }
+};
+
+Registry defaultRegistry() {
+    Registry registry;
+
+    registry.node_types.emplace(std::string("Sequence"),
+        std::function([](){ return std::make_unique<SequenceNode>(); }));
+    registry.node_types.emplace(std::string("ReactiveSequence"),
+        std::function([](){ return std::make_unique<ReactiveSequenceNode>(); }));
+    registry.node_types.emplace(std::string("Fallback"),
+        std::function([](){ return std::make_unique<FallbackNode>(); }));
+    registry.node_types.emplace(std::string("ReactiveFallbackStar"),
+        std::function([](){ return std::make_unique<ReactiveFallbackNode>(); }));
+    registry.node_types.emplace(std::string("ForceSuccess"),
+        std::function([](){ return std::make_unique<ForceSuccessNode>(); }));
+    registry.node_types.emplace(std::string("ForceFailure"),
+        std::function([](){ return std::make_unique<ForceFailureNode>(); }));
+    registry.node_types.emplace(std::string("Inverter"),
+        std::function([](){ return std::make_unique<InverterNode>(); }));
+    registry.node_types.emplace(std::string("Repeat"),
+        std::function([](){ return std::make_unique<RepeatNode>(); }));
+    registry.node_types.emplace(std::string("Retry"),
+        std::function([](){ return std::make_unique<RetryNode>(); }));
+    registry.node_types.emplace(std::string("true"),
+        std::function([](){ return std::make_unique<TrueNode>(); }));
+    registry.node_types.emplace(std::string("false"),
+        std::function([](){ return std::make_unique<FalseNode>(); }));
+    registry.node_types.emplace(std::string("SetBool"),
+        std::function([](){ return std::make_unique<SetBoolNode>(); }));
+    registry.node_types.emplace(std::string("if"),
+        std::function([](){ return std::make_unique<IfNode>(); }));
+    registry.node_types.emplace(std::string("Condition"),
+        std::function([](){ return std::make_unique<ConditionNode>(); }));
+    registry.node_types.emplace(std::string("IsTrue"),
+        std::function([](){ return std::make_unique<IsTrueNode>(); }));
+    // The factory is replaced by one with the table compiled from the ports of each node
+    registry.node_types.emplace(std::string("DecisionTable"),
+        std::function([](){ return std::make_unique<DecisionTableNode>(std::make_shared<const DecisionTable>()); }));
+    registry.node_types.emplace(std::string("UtilitySelector"),
+        std::function([](){ return std::make_unique<UtilitySelectorNode>(); }));
+    registry.node_types.emplace(std::string("AdaptiveFallback"),
+        std::function([](){ return std::make_unique<AdaptiveFallbackNode>(); }));
+
+    registry.pure_node_types = {
+        "Sequence", "ReactiveSequence", "Fallback", "ReactiveFallbackStar", "AdaptiveFallback",
+        "ForceSuccess", "ForceFailure", "Inverter", "true", "false", "if",
+        "Condition", "IsTrue", "DecisionTable", "UtilitySelector",
+    };
+
+    return registry;
+}
+
+/// A registry that plugins can update while other threads load trees with it.
+///
+/// Each update copies the current registry, modifies the copy and publishes it as
+/// a new immutable version. Readers hold a version with `read()` without waiting:
+/// they only increment a counter of their stripe and load a pointer. A replaced
+/// version is freed by a later `update()` or `reclaim()` once no reader that may
+/// have seen it is left, so updates never wait for readers either.
+///
+/// Each version is a new `Registry` with its own `Registry::id()`, so a `TreeSource`
+/// compiles its programs again for it.
+class ConcurrentRegistry {
+    static constexpr size_t stripes = 16;
+
+    /// Readers in each parity of the epoch, in a cache line per stripe
+    struct alignas(64) Stripe {
+        std::atomic<int64_t> readers[2] = {0, 0};
+    };
+
+    struct Retired {
+        const Registry* registry;
+        uint64_t epoch;
+    };
+
+    std::atomic<const Registry*> current;
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<uint64_t> updates{0};
+    mutable Stripe counters[stripes];
+    std::mutex update_mutex;
+    std::vector<Retired> retired;
+
+    static size_t stripe_of_thread() {
+        thread_local size_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % stripes;
+        return stripe;
+    }
+
+    /// Advances the epoch if no reader is left in the previous one, and frees the
+    /// versions replaced two epochs ago. A reader that may see a version entered
+    /// either parity before the version was replaced, and both parities are checked
+    /// to be empty after that before the version is freed.
+    void advance() {
+        auto e = epoch.load(std::memory_order_seq_cst);
+        auto previous = (e + 1) & 1;
+        bool idle = true;
+        for (auto& stripe : counters) {
+            if (stripe.readers[previous].load(std::memory_order_seq_cst) != 0) {
+                idle = false;
+                break;
+            }
+        }
+        if (idle) {
+            epoch.store(++e, std::memory_order_seq_cst);
+        }
+        auto it = std::remove_if(retired.begin(), retired.end(), [e](const Retired& r) {
+            if (r.epoch + 2 <= e) {
+                delete r.registry;
+                return true;
+            }
+            return false;
+        });
+        retired.erase(it, retired.end());
+    }
+
+public:
+    /// A version of the registry held by a reader. The version stays alive until
+    /// the guard is destroyed.
+    class ReadGuard {
+        const Registry* registry;
+        std::atomic<int64_t>* counter;
+        friend class ConcurrentRegistry;
+        ReadGuard(const Registry* registry, std::atomic<int64_t>* counter) :
+            registry(registry), counter(counter) {}
+    public:
+        ReadGuard(ReadGuard&& other) : registry(other.registry), counter(other.counter) {
+            other.counter = nullptr;
+        }
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+        ~ReadGuard() {
+            if (counter) counter->fetch_sub(1, std::memory_order_release);
+        }
+        const Registry& operator*() const { return *registry; }
+        const Registry* operator->() const { return registry; }
+        const Registry& get() const { return *registry; }
+    };
+
+    explicit ConcurrentRegistry(Registry registry = defaultRegistry()) :
+        current(new Registry(std::move(registry))) {}
+
+    ConcurrentRegistry(const ConcurrentRegistry&) = delete;
+    ConcurrentRegistry& operator=(const ConcurrentRegistry&) = delete;
+
+    /// Frees all the versions. No reader may be left.
+    ~ConcurrentRegistry() {
+        delete current.load();
+        for (auto& r : retired) {
+            delete r.registry;
+        }
+    }
+
+    /// Returns the current version to read, such as to pass to `load()`.
+    ReadGuard read() const {
+        auto& stripe = counters[stripe_of_thread()];
+        auto counter = &stripe.readers[epoch.load(std::memory_order_seq_cst) & 1];
+        counter->fetch_add(1, std::memory_order_seq_cst);
+        return ReadGuard(current.load(std::memory_order_seq_cst), counter);
+    }
+
+    /// Publishes a copy of the current version modified by `f(Registry&)`.
+    /// Updates are serialized among themselves, but readers are never blocked.
+    template<typename F>
+    void update(F f) {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        auto next = new Registry(*current.load(std::memory_order_seq_cst));
+        try {
+            f(*next);
+        }
+        catch (...) {
+            delete next;
+            throw;
+        }
+        auto prev = current.exchange(next, std::memory_order_seq_cst);
+        retired.push_back(Retired{ prev, epoch.load(std::memory_order_seq_cst) });
+        updates.fetch_add(1, std::memory_order_release);
+        advance();
+    }
+
+    /// Registers a node type, replacing the one with the same name.
+    void emplace(const std::string& name, std::function<std::unique_ptr<BehaviorNode> ()> factory) {
+        update([&](Registry& registry) {
+            registry.node_types.insert_or_assign(name, std::move(factory));
+        });
+    }
+
+    /// Frees the replaced versions that no reader can see anymore.
+    void reclaim() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        advance();
+        advance();
+    }
+
+    /// The number of updates published so far.
+    uint64_t version() const {
+        return updates.load(std::memory_order_acquire);
+    }
+
+    /// The number of replaced versions not freed yet.
+    size_t pending() {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        return retired.size();
+    }
+};
+
+/// A node of a `Program`.
+struct ProgramNode {
+    std::string name;
+    /// Creates the node. It is empty for a subtree call, which creates a `SubtreeNode`.
+    std::function<std::unique_ptr<BehaviorNode> ()> factory;
+    /// The ports of the called subtree
+    std::vector<PortSpec> subtree_ports;
+    BBMap blackboard_map;
+    /// Indices of the child nodes in `Program::nodes`
+    std::vector<size_t> children;
+    size_t source_offset = 0;
+    std::shared_ptr<const SourceMap> source_map;
+    /// The cached result shared with identical nodes in the tree, or -1
+    int cse_slot = -1;
+    /// The number of cached results in the tree, if this is the root of a tree
+    size_t cse_slots = 0;
+    /// The table of a node lowered by `lower_fsm()`
+    std::shared_ptr<const FsmTable> fsm;
+};
+
+/// A tree whose node types and subtrees are already resolved against a registry.
+/// Instantiating a program does not look up any name or walk the `TreeDef`s.
+///
+/// The root is the first node. The body of a subtree is compiled only once
+/// and shared by all the nodes calling it.
+///
+/// Identical pure leaf nodes in a tree, such as the same condition guarding several
+/// branches, share a cached result, so that only the first of them is ticked in a
+/// tick. The cache is invalidated by writes through `Context::set()`, but not by
+/// writes to `Context::blackboard` or the columns made directly by a node. Each call
+/// of a subtree has a cache of its own.
+struct Program {
+    std::string entry;
+    std::vector<ProgramNode> nodes;
+};
+
+/// The tree being compiled, which a node is resolved in.
+struct CompileScope {
+    /// Ports of the tree and the variables declared or mapped to ports in it
+    std::unordered_set<std::string> variables;
+    /// The pure leaf nodes of the tree by their name and ports
+    std::unordered_map<std::string, std::vector<size_t>> pure_leaves;
+    /// Variables written but never read in the tree, if dead stores are eliminated
+    std::unordered_set<std::string> dead_variables;
+    /// The values of the spawn-constant variables, which are folded into the ports
+    /// and the `Condition` expressions. Only given for the entry tree.
+    const Blackboard* constants = nullptr;
+
+    const std::string* constant(const std::string& name) const {
+        if (!constants) return nullptr;
+        auto it = constants->find(name);
+        return it != constants->end() ? &it->second : nullptr;
+    }
+
+    static CompileScope of(const TreeDef& node, const std::vector<PortDef>& ports = {}) {
+        CompileScope scope;
+        for (auto& port : ports) {
+            scope.variables.insert(port.name);
+        }
+        scope.collect(node);
+        return scope;
+    }
+
+    /// Records the node if it is a pure leaf whose result can be shared with
+    /// identical nodes in the tree. Nodes with output ports are never shared.
+    void add_pure_leaf(const ProgramNode& node, size_t index, const Registry& registry) {
+        if (!node.factory || !node.children.empty() || !registry.pure_node_types.count(node.name)) return;
+        std::vector<std::pair<std::string, const BlackboardValue*>> ports;
+        for (auto& [port, value] : node.blackboard_map) {
+            ports.emplace_back(port, &value);
+        }
+        std::sort(ports.begin(), ports.end());
+        auto key = node.name;
+        for (auto& [port, value] : ports) {
+            key += '\0' + port + '\0';
+            if (auto x = std::get_if<0>(value)) {
+                if (x->second != PortType::Input) return;
+                key += "v" + x->first;
+            }
+            else if (auto x = std::get_if<1>(value)) {
+                key += "l" + *x;
+            }
+            else if (auto x = std::get_if<FieldPort>(value)) {
+                if (x->ty != PortType::Input) return;
+                key += "f" + std::to_string(x->binding.offset) + x->binding.user_type->name();
+            }
+            else {
+                return;
+            }
+        }
+        pure_leaves[key].push_back(index);
+    }
+
+    /// Assigns a cached result to each set of identical pure leaves in the tree at `root`.
+    void assign_cse_slots(Program& program, size_t root) const;
+
+    /// Finds the variables written but never read in the tree, see `find_dead_stores()`.
+    void find_dead_variables(const TreeDef& root, const std::vector<PortDef>& ports,
+        const TreeSource& tree_source, const Registry& registry);
+
+private:
+    void collect(const TreeDef& node) {
+        for (auto& var : node.vars) {
+            variables.insert(var.name);
+        }
+        for (auto& port : node.port_maps) {
+            if (!port.blackboard_literal) variables.insert(port.value);
+        }
+        for (auto& child : node.children) {
+            collect(child);
+        }
+    }
+};
+
+inline void CompileScope::assign_cse_slots(Program& program, size_t root) const {
+    size_t slots = 0;
+    for (auto& [_, nodes] : pure_leaves) {
+        if (nodes.size() < 2) continue;
+        for (auto index : nodes) {
+            program.nodes[index].cse_slot = static_cast<int>(slots);
+        }
+        slots++;
+    }
+    program.nodes[root].cse_slots = slots;
+}
+
+/// Whether `node` is the condition of an `if` naming a variable rather than a node,
+/// as in `if (has_target)`.
+inline bool is_variable_guard(
+    const TreeDef& node,
+    const TreeSource& tree_source,
+    const Registry& registry,
+    const CompileScope& scope
+) {
+    return node.children.empty() && node.port_maps.empty()
+        && scope.variables.count(node.name)
+        && !registry.node_types.count(node.name)
+        && !tree_source.find(node.name);
+}
+
+/// Collects the variables read in the tree: the input ports, the variables in
+/// `Condition` expressions and the variables of `if` guards. Returns false if
+/// the reads cannot be known, because an expression is given in a variable.
+inline bool collect_reads(
+    const TreeDef& node,
+    const TreeSource& tree_source,
+    const Registry& registry,
+    const CompileScope& scope,
+    std::unordered_set<std::string>& reads
+) {
+    bool ret = true;
+    for (auto& port : node.port_maps) {
+        bool expression = node.name == "Condition" && port.node_port == "expr";
+        if (!port.blackboard_literal) {
+            if (port.ty != PortType::Output) reads.insert(port.value);
+            if (expression) ret = false;
+        }
+        else if (expression) {
+            auto res = Expression::parse(port.value);
+            if (auto e = std::get_if<Expression>(&res)) {
+                for (auto& variable : e->variables()) reads.insert(variable);
+            }
+        }
+    }
+    for (size_t i = 0; i < node.children.size(); i++) {
+        auto& child = node.children[i];
+        if (node.name == "if" && i == 0 && is_variable_guard(child, tree_source, registry, scope)) {
+            reads.insert(child.name);
+            continue;
+        }
+        ret = collect_reads(child, tree_source, registry, scope, reads) && ret;
+    }
+    return ret;
+}
+
+/// Collects the variables mapped to the output and inout ports in the tree.
+inline void collect_writes(const TreeDef& node, std::unordered_set<std::string>& writes) {
+    for (auto& port : node.port_maps) {
+        if (!port.blackboard_literal && port.ty != PortType::Input) writes.insert(port.value);
+    }
+    for (auto& child : node.children) {
+        collect_writes(child, writes);
+    }
+}
+
+inline void CompileScope::find_dead_variables(const TreeDef& root, const std::vector<PortDef>& ports,
+    const TreeSource& tree_source, const Registry& registry)
+{
+    std::unordered_set<std::string> reads;
+    if (!collect_reads(root, tree_source, registry, *this, reads)) return;
+    std::unordered_set<std::string> writes;
+    collect_writes(root, writes);
+    for (auto& variable : writes) {
+        if (reads.count(variable) || registry.external_variables.count(variable)
+            || registry.field_bindings.count(variable)) continue;
+        // The caller reads the output ports of the tree
+        auto port = std::find_if(ports.begin(), ports.end(), [&variable](auto& port) {
+            return port.name == variable && port.direction != PortType::Input;
+        });
+        if (port != ports.end()) continue;
+        dead_variables.insert(variable);
+    }
+}
+
+/// Creates the scope to compile a tree in.
+inline CompileScope compile_scope(const TreeDef& root, const std::vector<PortDef>& ports,
+    const TreeSource& tree_source, const Registry& registry)
+{
+    auto scope = CompileScope::of(root, ports);
+    if (registry.eliminate_dead_stores) {
+        scope.find_dead_variables(root, ports, tree_source, registry);
+    }
+    return scope;
+}
+
+/// A write to a variable that no node in the tree, caller of the tree or declared
+/// external consumer reads.
+struct DeadStore {
+    std::string tree;
+    std::string variable;
+    /// The node writing the variable and its port
+    std::string node;
+    std::string port;
+    std::optional<SourceLocation> location;
+};
+
+inline std::ostream &operator<<(std::ostream& os, const DeadStore& store) {
+    if (store.location) os << *store.location << ": ";
+    return os << store.node << "(" << store.port << " -> " << store.variable << ") in tree "
+        << store.tree << " writes a variable that nothing reads";
+}
+
+inline void collect_dead_stores(const TreeDef& node, const Tree& tree, const CompileScope& scope,
+    std::vector<DeadStore>& ret)
+{
+    for (auto& port : node.port_maps) {
+        if (port.blackboard_literal || port.ty != PortType::Output || !scope.dead_variables.count(port.value)) continue;
+        ret.push_back(DeadStore {
+            .tree = tree.name,
+            .variable = port.value,
+            .node = node.name,
+            .port = port.node_port,
+            .location = tree.source_map ? std::optional(tree.source_map->locate(node.offset)) : std::nullopt,
+        });
+    }
+    for (auto& child : node.children) {
+        collect_dead_stores(child, tree, scope, ret);
+    }
+}
+
+/// Finds the writes to variables that nothing reads in each tree. A variable is read
+/// if an input port of a node in the same tree is mapped to it, it appears in a
+/// `Condition` expression or an `if` guard, it is an output port of the tree, or it
+/// is in `Registry::external_variables` or bound to a field.
+///
+/// With `Registry::eliminate_dead_stores`, the compiler maps the output ports of
+/// these writes to `DiscardedPort`, so that `Context::set()` does nothing.
+/// Nodes that read the blackboard without ports are not seen, so declare the
+/// variables they read as external.
+inline std::vector<DeadStore> find_dead_stores(const TreeSource& tree_source, const Registry& registry) {
+    std::vector<DeadStore> ret;
+    for (auto& tree : tree_source) {
+        auto scope = CompileScope::of(tree.node, tree.ports);
+        scope.find_dead_variables(tree.node, tree.ports, tree_source, registry);
+        collect_dead_stores(tree.node, tree, scope, ret);
+    }
+    return ret;
+}
+
+/// Throws `impure_node_error` if the node at `index` or its descendants are not pure.
+/// Subtree calls are not pure, since they write their output ports.
+inline void check_pure(const Program& program, size_t index, const Registry& registry, const std::string& parent) {
+    auto& node = program.nodes[index];
+    if (!node.factory || !registry.pure_node_types.count(node.name)) {
+        throw impure_node_error{node.name, parent,
+            node.source_map ? std::optional(node.source_map->locate(node.source_offset)) : std::nullopt};
+    }
+    for (auto child : node.children) {
+        check_pure(program, child, registry, parent);
+    }
+}
+
+/// Checks the children of an AdaptiveFallback, and freezes its order if it has a profile.
+inline void compile_adaptive_fallback(const Program& program, ProgramNode& node, const Registry& registry) {
+    for (auto child : node.children) {
+        check_pure(program, child, registry, node.name);
+    }
+
+    std::string id;
+    auto id_port = node.blackboard_map.find("id");
+    if (id_port != node.blackboard_map.end() && std::get_if<std::string>(&id_port->second)) {
+        id = std::get<std::string>(id_port->second);
+    }
+    else if (node.source_map) {
+        id = to_string(node.source_map->locate(node.source_offset));
+    }
+
+    std::optional<std::vector<size_t>> order;
+    auto profile = node.blackboard_map.find("profile");
+    if (profile != node.blackboard_map.end() && std::get_if<std::string>(&profile->second)) {
+        auto size = node.children.size();
+        // The profile of the first run does not exist yet
+        std::filesystem::path path = std::get<std::string>(profile->second);
+        std::error_code ec;
+        std::optional<std::vector<size_t>> recorded;
+        if (std::filesystem::exists(path, ec)) {
+            recorded = AdaptiveProfile::read(path).order(id);
+        }
+        // A profile recorded before the children were changed is ignored
+        auto is_permutation = [size](std::vector<size_t> v) {
+            std::sort(v.begin(), v.end());
+            for (size_t i = 0; i < v.size(); i++) {
+                if (v[i] != i) return false;
+            }
+            return v.size() == size;
+        };
+        if (recorded && is_permutation(*recorded)) {
+            order = *recorded;
+        }
+        else {
+            order.emplace(size);
+            for (size_t i = 0; i < size; i++) (*order)[i] = i;
+        }
+    }
+
+    node.factory = [id, order]() {
+        return std::make_unique<AdaptiveFallbackNode>(id, order);
+    };
+}
+
+/// Replaces the children of a ReactiveFallbackStar with the bodies of its `if`s if
+/// all of them are variable guards without `else`, so that it can be ticked as a
+/// `BitmaskFallbackNode`. The `if`s and their guards are left unreachable, to be
+/// removed by `remove_unreachable_nodes()`.
+///
+/// The fallback is kept as is if a port in it writes to one of the guards, since
+/// the interpreted fallback reads a guard only after the branches before it ran.
+inline void compile_bitmask_fallback(const Program& program, ProgramNode& node, const TreeDef& parent, CompileScope& scope) {
+    if (node.children.empty() || node.children.size() > BitmaskFallbackNode::max_guards
+        || node.children.size() != parent.children.size()) return;
+    std::unordered_set<std::string> writes;
+    collect_writes(parent, writes);
+    std::vector<BlackboardValue> guards;
+    std::vector<size_t> bodies;
+    std::vector<size_t> conditions;
+    for (size_t i = 0; i < node.children.size(); i++) {
+        auto& if_node = program.nodes[node.children[i]];
+        if (if_node.name != "if" || if_node.children.size() != 2) return;
+        auto& condition = program.nodes[if_node.children[0]];
+        auto input = condition.blackboard_map.find("input");
+        if (condition.name != "IsTrue" || input == condition.blackboard_map.end()) return;
+        // The variable of `if (var)`, or the variables mapped to an IsTrue node
+        auto& guard = parent.children[i].children[0];
+        bool written = guard.port_maps.empty() ? writes.count(guard.name) > 0
+            : std::any_of(guard.port_maps.begin(), guard.port_maps.end(), [&writes](auto& port) {
+                return !port.blackboard_literal && writes.count(port.value) > 0;
+            });
+        if (written) return;
+        guards.push_back(input->second);
+        bodies.push_back(if_node.children[1]);
+        conditions.push_back(if_node.children[0]);
+    }
+    // The guards are read by the node itself, so they must not take a cached result
+    for (auto& [_, leaves] : scope.pure_leaves) {
+        leaves.erase(std::remove_if(leaves.begin(), leaves.end(), [&conditions](size_t leaf) {
+            return std::find(conditions.begin(), conditions.end(), leaf) != conditions.end();
+        }), leaves.end());
+    }
+    node.factory = [guards = std::move(guards)]() {
+        return std::make_unique<BitmaskFallbackNode>(guards);
+    };
+    node.children = std::move(bodies);
+}
+
+/// Adds an input port to a `Condition` node for each variable of its literal
+/// expression bound to a field, which `ConditionNode` reads the field through.
+inline void add_field_ports(ProgramNode& node, const Registry& registry) {
+    if (registry.field_bindings.empty()) return;
+    auto it = node.blackboard_map.find("expr");
+    auto text = it != node.blackboard_map.end() ? std::get_if<1>(&it->second) : nullptr;
+    if (!text) return;
+    auto res = Expression::parse(*text);
+    auto expression = std::get_if<Expression>(&res);
+    if (!expression) return;
+    for (auto& variable : expression->variables()) {
+        auto binding = registry.field_bindings.find(variable);
+        if (binding == registry.field_bindings.end() || node.blackboard_map.count(variable)) continue;
+        node.blackboard_map.emplace(variable, FieldPort{ binding->second, PortType::Input });
+    }
+}
+
+/// Collects the variables declared with an initializer in the tree, as in `var x = true`.
+inline void collect_initialized_variables(const TreeDef& node, std::unordered_set<std::string>& names) {
+    for (auto& var : node.vars) {
+        if (var.init) names.insert(var.name);
+    }
+    for (auto& child : node.children) {
+        collect_initialized_variables(child, names);
+    }
+}
+
+/// Folds the constants of the scope into the text of a `Condition` expression.
+/// The text is kept as is if it does not parse, to report the error at the first tick.
+inline std::string fold_constants(const std::string& text, const CompileScope& scope) {
+    auto res = Expression::parse(text);
+    auto expression = std::get_if<Expression>(&res);
+    if (!expression) return text;
+    auto folded = expression->fold([&scope](const std::string& name) -> std::optional<double> {
+        auto value = scope.constant(name);
+        if (!value) return std::nullopt;
+        auto number = parse_number(*value);
+        if (!std::isfinite(number)) return std::nullopt;
+        return number;
+    });
+    return folded.to_string();
+}
+
+inline size_t compile_recurse(
+    Program& program,
+    const TreeDef& parent,
+    const TreeSource& tree_source,
+    const Registry& registry,
+    const std::shared_ptr<const SourceMap>& source_map,
+    std::unordered_map<const Tree*, size_t>& subtree_bodies,
+    CompileScope& scope
+) {
+    auto index = program.nodes.size();
+    program.nodes.emplace_back();
+
+    ProgramNode ret;
+    ret.name = parent.name;
+    ret.source_offset = parent.offset;
+    ret.source_map = source_map;
+
+    if (auto tree = tree_source.find(parent.name)) {
+        std::transform(tree->ports.begin(), tree->ports.end(), std::back_inserter(ret.subtree_ports),
+            [](auto& port) {
+                return PortSpec {
+                    .ty = port.direction,
+                    .key = port.name,
+                };
+            });
+        auto body_it = subtree_bodies.find(tree);
+        if (body_it == subtree_bodies.end()) {
+            auto body_scope = compile_scope(tree->node, tree->ports, tree_source, registry);
+            auto body = compile_recurse(program, tree->node, tree_source, registry, tree->source_map, subtree_bodies, body_scope);
+            body_scope.assign_cse_slots(program, body);
+            body_it = subtree_bodies.emplace(tree, body).first;
+        }
+        ret.children.push_back(body_it->second);
+    }
+    else {
+        for (size_t i = 0; i < parent.children.size(); i++) {
+            auto& child = parent.children[i];
+            if (parent.name == "if" && i == 0 && is_variable_guard(child, tree_source, registry, scope)) {
+                TreeDef guard {
+                    .name = "IsTrue",
+                    .port_maps = PortMaps{PortMap {
+                        .ty = PortType::Input,
+                        .blackboard_literal = false,
+                        .node_port = "input",
+                        .value = child.name,
+                    }},
+                    .children = {},
+                    .vars = {},
+                    .offset = child.offset,
+                };
+                ret.children.push_back(compile_recurse(program, guard, tree_source, registry, source_map, subtree_bodies, scope));
+                continue;
+            }
+            ret.children.push_back(compile_recurse(program, child, tree_source, registry, source_map, subtree_bodies, scope));
+        }
+
+        auto node_it = registry.node_types.find(parent.name);
+        if (node_it == registry.node_types.end()) {
+            throw undefined_node_error{parent.name,
+                source_map ? std::optional(source_map->locate(parent.offset)) : std::nullopt};
+        }
+        ret.factory = node_it->second;
+    }
+
+    for (auto& port_map : parent.port_maps) {
+        auto constant = port_map.blackboard_literal ? nullptr : scope.constant(port_map.value);
+        if (constant && port_map.ty != PortType::Input) {
+            throw write_to_constant_error{port_map.value,
+                source_map ? std::optional(source_map->locate(parent.offset)) : std::nullopt};
+        }
+        if (constant) {
+            ret.blackboard_map.emplace(port_map.node_port, *constant);
+        }
+        else if (ret.name == "Condition" && port_map.node_port == "expr" && port_map.blackboard_literal && scope.constants) {
+            ret.blackboard_map.emplace(port_map.node_port, fold_constants(port_map.value, scope));
+        }
+        else if (port_map.blackboard_literal) {
+            ret.blackboard_map.emplace(port_map.node_port, port_map.value);
+        }
+        else if (port_map.ty == PortType::Output && scope.dead_variables.count(port_map.value)) {
+            ret.blackboard_map.emplace(port_map.node_port, DiscardedPort{ port_map.value });
+        }
+        else if (auto binding = registry.field_bindings.find(port_map.value); binding != registry.field_bindings.end()) {
+            ret.blackboard_map.emplace(port_map.node_port, FieldPort{ binding->second, port_map.ty });
+        }
+        else {
+            ret.blackboard_map.emplace(port_map.node_port, std::make_pair(port_map.value, port_map.ty));
+        }
+    }
+
+    if (ret.name == "Condition" && ret.factory) {
+        add_field_ports(ret, registry);
+    }
+
+    if (ret.name == "ReactiveFallbackStar") {
+        compile_bitmask_fallback(program, ret, parent, scope);
+    }
+    else if (ret.name == "AdaptiveFallback") {
+        compile_adaptive_fallback(program, ret, registry);
+    }
+    else if (ret.name == "DecisionTable") {
+        auto table = std::make_shared<const DecisionTable>(DecisionTable::compile(ret.blackboard_map, ret.children.size()));
+        ret.factory = [table]() {
+            return std::make_unique<DecisionTableNode>(table);
+        };
+    }
+
+    scope.add_pure_leaf(ret, index, registry);
+    program.nodes[index] = std::move(ret);
+    return index;
+}
+
+/// Removes the nodes that are not reachable from the root at index 0 and renumbers
+/// the others in the same order.
+inline void remove_unreachable_nodes(Program& program) {
+    std::vector<bool> reachable(program.nodes.size(), false);
+    std::vector<size_t> stack{0};
+    reachable[0] = true;
+    while (!stack.empty()) {
+        auto index = stack.back();
+        stack.pop_back();
+        for (auto child : program.nodes[index].children) {
+            if (!reachable[child]) {
+                reachable[child] = true;
+                stack.push_back(child);
+            }
+        }
+    }
+    std::vector<size_t> renumbered(program.nodes.size());
+    size_t count = 0;
+    for (size_t i = 0; i < program.nodes.size(); i++) {
+        if (!reachable[i]) continue;
+        renumbered[i] = count;
+        if (count != i) program.nodes[count] = std::move(program.nodes[i]);
+        count++;
+    }
+    program.nodes.resize(count);
+    for (auto& node : program.nodes) {
+        for (auto& child : node.children) {
+            child = renumbered[child];
+        }
+    }
+}
+
+/// The role of a node in a state machine compiled by `lower_fsm()`.
+enum class FsmKind {
+    Leaf,
+    Sequence,
+    Fallback,
+    Inverter,
+    ForceSuccess,
+    ForceFailure,
+    If,
+    True,
+    False,
+};
+
+/// Returns how the node is compiled to a state machine. Only the nodes created by
+/// the factories of `defaultRegistry()` are compiled, so a node type that a registry
+/// replaces under the same name is a leaf. An `if` is a leaf unless its condition
+/// is a leaf too, which is ticked again in each tick.
+inline FsmKind fsm_kind(const Program& program, size_t index) {
+    struct Kind {
+        FsmKind kind;
+        const std::type_info* factory;
+    };
+    static const auto kinds = []() {
+        auto registry = defaultRegistry();
+        std::unordered_map<std::string, Kind> ret;
+        for (auto [name, kind] : {
+            std::make_pair("Sequence", FsmKind::Sequence),
+            std::make_pair("Fallback", FsmKind::Fallback),
+            std::make_pair("Inverter", FsmKind::Inverter),
+            std::make_pair("ForceSuccess", FsmKind::ForceSuccess),
+            std::make_pair("ForceFailure", FsmKind::ForceFailure),
+            std::make_pair("if", FsmKind::If),
+            std::make_pair("true", FsmKind::True),
+            std::make_pair("false", FsmKind::False),
+        }) {
+            ret.emplace(name, Kind{ kind, &registry.node_types.at(name).target_type() });
+        }
+        return ret;
+    }();
+    auto& node = program.nodes[index];
+    if (!node.factory) return FsmKind::Leaf;
+    auto it = kinds.find(node.name);
+    if (it == kinds.end() || node.factory.target_type() != *it->second.factory) return FsmKind::Leaf;
+    if (it->second.kind == FsmKind::If && !node.children.empty()) {
+        auto condition = fsm_kind(program, node.children[0]);
+        if (condition != FsmKind::Leaf && condition != FsmKind::True && condition != FsmKind::False) {
+            return FsmKind::Leaf;
+        }
+    }
+    return it->second.kind;
+}
+
+/// Builds the `FsmTable` of a part of a program.
+class FsmCompiler {
+    struct Node {
+        FsmKind kind;
+        int parent;
+        /// The index among the children of the parent
+        size_t position;
+        std::vector<size_t> children;
+        /// The index among the leaves
+        size_t leaf = 0;
+    };
+
+    const Program& program;
+    std::vector<Node> nodes;
+
+    size_t add(size_t index, int parent, size_t position) {
+        auto kind = fsm_kind(program, index);
+        auto id = nodes.size();
+        nodes.push_back(Node{ kind, parent, position, {} });
+        if (kind == FsmKind::Leaf) {
+            nodes[id].leaf = leaves.size();
+            leaves.push_back(index);
+            return id;
+        }
+        // The children the node ticks
+        auto& children = program.nodes[index].children;
+        size_t count = children.size();
+        switch (kind) {
+            case FsmKind::Inverter: case FsmKind::ForceSuccess: case FsmKind::ForceFailure:
+                count = std::min<size_t>(count, 1);
+                break;
+            case FsmKind::If: count = std::min<size_t>(count, 3); break;
+            case FsmKind::True: case FsmKind::False: count = 0; break;
+            default: break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            auto child = add(children[i], static_cast<int>(id), i);
+            nodes[id].children.push_back(child);
+        }
+        return id;
+    }
+
+    FsmTable::Step enter(size_t id) {
+        auto& node = nodes[id];
+        switch (node.kind) {
+            case FsmKind::Leaf: return FsmTable::Step{ static_cast<int>(node.leaf) };
+            case FsmKind::True: return propagate(id, BehaviorResult::Success);
+            case FsmKind::False: return propagate(id, BehaviorResult::Fail);
+            case FsmKind::Sequence: case FsmKind::ForceSuccess:
+                if (node.children.empty()) return propagate(id, BehaviorResult::Success);
+                break;
+            default:
+                if (node.children.empty()) return propagate(id, BehaviorResult::Fail);
+        }
+        return enter(node.children[0]);
+    }
+
+    /// What follows the node returning the result
+    FsmTable::Step propagate(size_t id, BehaviorResult result) {
+        auto& node = nodes[id];
+        if (node.parent < 0) return FsmTable::Step{ -1, result };
+        auto parent = static_cast<size_t>(node.parent);
+        auto& siblings = nodes[parent].children;
+        auto next = node.position + 1;
+        if (result == BehaviorResult::Running && nodes[parent].kind != FsmKind::If) {
+            return propagate(parent, result);
+        }
+        switch (nodes[parent].kind) {
+            case FsmKind::Sequence:
+                if (result == BehaviorResult::Success && next < siblings.size()) return enter(siblings[next]);
+                return propagate(parent, result);
+            case FsmKind::Fallback:
+                if (result == BehaviorResult::Fail && next < siblings.size()) return enter(siblings[next]);
+                return propagate(parent, result);
+            case FsmKind::Inverter:
+                return propagate(parent, result == BehaviorResult::Success ? BehaviorResult::Fail : BehaviorResult::Success);
+            case FsmKind::ForceSuccess:
+                return propagate(parent, BehaviorResult::Success);
+            case FsmKind::ForceFailure:
+                return propagate(parent, BehaviorResult::Fail);
+            case FsmKind::If:
+                if (node.position == 0) return enter_branch(parent, result == BehaviorResult::Fail ? 2 : 1);
+                return propagate(parent, result);
+            default:
+                return propagate(parent, result);
+        }
+    }
+
+    FsmTable::Step enter_branch(size_t id, size_t branch) {
+        auto& children = nodes[id].children;
+        if (branch < children.size()) return enter(children[branch]);
+        return propagate(id, BehaviorResult::Fail);
+    }
+
+    void collect_leaves(size_t id, std::vector<size_t>& ret) const {
+        if (nodes[id].kind == FsmKind::Leaf) ret.push_back(nodes[id].leaf);
+        for (auto child : nodes[id].children) {
+            collect_leaves(child, ret);
+        }
+    }
+
+public:
+    /// The nodes of the program that are the leaves, in the order of their indices
+    std::vector<size_t> leaves;
+
+    explicit FsmCompiler(const Program& program) : program(program) {}
+
+    FsmTable compile(size_t root) {
+        nodes.clear();
+        leaves.clear();
+        add(root, -1, 0);
+        FsmTable table;
+        table.start = enter(0);
+        table.transitions.resize(leaves.size() * 3);
+        table.guards.resize(leaves.size());
+        for (size_t id = 0; id < nodes.size(); id++) {
+            auto& node = nodes[id];
+            if (node.kind != FsmKind::Leaf) continue;
+            for (auto result : {BehaviorResult::Success, BehaviorResult::Fail, BehaviorResult::Running}) {
+                table.transitions[node.leaf * 3 + static_cast<int>(result)] = propagate(id, result);
+            }
+            auto& guards = table.guards[node.leaf];
+            for (auto child = id; nodes[child].parent >= 0; child = nodes[child].parent) {
+                auto& parent = nodes[nodes[child].parent];
+                if (parent.kind != FsmKind::If || nodes[child].position == 0) continue;
+                auto& condition = nodes[parent.children[0]];
+                // A constant condition always takes the branch the leaf is in
+                if (condition.kind != FsmKind::Leaf) continue;
+                FsmTable::Guard guard{ condition.leaf, static_cast<int>(nodes[child].position), {}, {} };
+                guard.enter[0] = enter_branch(nodes[child].parent, 1);
+                guard.enter[1] = enter_branch(nodes[child].parent, 2);
+                collect_leaves(child, guard.halt);
+                guards.push_back(std::move(guard));
+            }
+            std::reverse(guards.begin(), guards.end());
+        }
+        return table;
+    }
+};
+
+/// Replaces the largest parts of the program made of Sequence, Fallback, Inverter,
+/// ForceSuccess, ForceFailure and `if` nodes with `FsmNode`s, which resume the
+/// Running leaf and follow a table to the next leaf instead of descending from
+/// the root. Other nodes, such as reactive nodes, decorators with a state and
+/// subtree calls, are the leaves, whose descendants are lowered separately.
+///
+/// The names are assumed to be the built-in nodes of `defaultRegistry()`.
+inline void lower_fsm(Program& program, size_t index, std::unordered_set<size_t>& visited) {
+    if (!visited.insert(index).second) return;
+    auto kind = fsm_kind(program, index);
+    if (kind == FsmKind::Leaf || kind == FsmKind::True || kind == FsmKind::False) {
+        auto children = program.nodes[index].children;
+        for (auto child : children) {
+            lower_fsm(program, child, visited);
+        }
+        return;
+    }
+    FsmCompiler compiler(program);
+    auto table = std::make_shared<const FsmTable>(compiler.compile(index));
+    for (auto leaf : compiler.leaves) {
+        auto children = program.nodes[leaf].children;
+        for (auto child : children) {
+            lower_fsm(program, child, visited);
+        }
+    }
+    auto& node = program.nodes[index];
+    node.name = "Fsm";
+    node.factory = [table]() { return std::make_unique<FsmNode>(table); };
+    node.fsm = table;
+    node.blackboard_map.clear();
+    node.children = compiler.leaves;
+    node.cse_slot = -1;
+}
+
+/// Compiles the tree named `entry` and the subtrees it calls.
+/// Returns nullptr if there is no such tree.
+///
+/// The variables in `constants` are replaced by their values in the entry tree,
+/// which specializes the program for agents starting with these values. The values
+/// become literals of the ports mapped to the variables and are folded into the
+/// `Condition` expressions. The variables are not replaced in the subtrees, but the
+/// ports passing them to the subtrees become literals. Variables declared with an
+/// initializer in the entry tree are not constants. Throws `write_to_constant_error`
+/// if a node writes to one of them.
+inline std::shared_ptr<const Program> compile(
+    const TreeSource& tree_source,
+    const Registry& registry,
+    std::string_view entry = "main",
+    const Blackboard& constants = {}
+) {
+    auto tree = tree_source.find(entry);
+    if (!tree) {
+        return nullptr;
+    }
+    auto program = std::make_shared<Program>();
+    program->entry = std::string(entry);
+    std::unordered_map<const Tree*, size_t> subtree_bodies;
+    auto scope = compile_scope(tree->node, tree->ports, tree_source, registry);
+    // A variable declared with an initializer gets its value from it, not from the
+    // blackboard the agent is spawned with
+    Blackboard folded;
+    if (!constants.empty()) {
+        std::unordered_set<std::string> initialized;
+        collect_initialized_variables(tree->node, initialized);
+        for (auto& constant : constants) {
+            if (!initialized.count(constant.first)) folded.insert(constant);
+        }
+    }
+    if (!folded.empty()) scope.constants = &folded;
+    compile_recurse(*program, tree->node, tree_source, registry, tree->source_map, subtree_bodies, scope);
+    scope.assign_cse_slots(*program, 0);
+    remove_unreachable_nodes(*program);
+    if (registry.compile_fsm) {
+        std::unordered_set<size_t> visited;
+        lower_fsm(*program, 0, visited);
+    }
+    return program;
+}
+
+inline std::shared_ptr<const Program> TreeSource::program(
+    std::string_view entry,
+    const Registry& registry,
+    const Blackboard& constants
+) const {
+    auto key = std::string(entry);
+    if (!constants.empty()) {
+        std::vector<std::pair<std::string, std::string>> sorted(constants.begin(), constants.end());
+        std::sort(sorted.begin(), sorted.end());
+        for (auto& [name, value] : sorted) {
+            key += '\0' + name + '=' + value;
+        }
+    }
+    auto fingerprint = registry.fingerprint();
+    bool generic = false;
+    {
+        std::lock_guard lock(cache.mutex);
+        auto it = cache.programs.find(key);
+        if (it != cache.programs.end() && it->second.registry_id == registry.id()
+            && it->second.registry_fingerprint == fingerprint)
+        {
+            return it->second.program;
+        }
+        generic = it == cache.programs.end() && !constants.empty()
+            && cache.specializations[std::string(entry)] >= registry.max_specializations;
+    }
+    if (generic) {
+        return program(entry, registry);
+    }
+    // Compile without the lock, since compiling looks up the trees
+    auto ret = compile(*this, registry, entry, constants);
+    if (ret) {
+        std::lock_guard lock(cache.mutex);
+        if (cache.programs.insert_or_assign(key, CachedProgram{ registry.id(), fingerprint, ret }).second
+            && !constants.empty())
+        {
+            cache.specializations[std::string(entry)]++;
+        }
+    }
+    return ret;
+}
+
+using CachedResults = std::vector<std::shared_ptr<CachedResult>>;
+
+/// Creates the node at `index` of the program over its already created children.
+inline BehaviorNodeContainer instantiate_node(
+    const Program& program,
+    size_t index,
+    std::vector<BehaviorNodeContainer> child_nodes,
+    const CachedResults& cached
+) {
+    auto& program_node = program.nodes[index];
+    std::unique_ptr<BehaviorNode> node;
+    if (program_node.factory) {
+        node = program_node.factory();
+    }
+    else {
+        node = std::make_unique<SubtreeNode>(Blackboard{}, program_node.subtree_ports);
+    }
+
+    auto ret = BehaviorNodeContainer(
+        program_node.name,
+        std::move(node),
+        program_node.blackboard_map,
+        std::move(child_nodes)
+    );
+    ret.source_offset = program_node.source_offset;
+    ret.source_map = program_node.source_map;
+    if (program_node.cse_slot >= 0) {
+        ret.cached = cached[program_node.cse_slot];
+    }
+    return ret;
+}
+
+/// Creates the cached results of a tree whose root is the node at `index`, or
+/// returns `cached` of the caller if the node is not the root of a tree.
+inline CachedResults cached_results_of(const Program& program, size_t index, CachedResults cached) {
+    auto& program_node = program.nodes[index];
+    if (program_node.cse_slots) {
+        // The root of a tree, whose nodes share the results in their own cache
+        cached.clear();
+        for (size_t i = 0; i < program_node.cse_slots; i++) {
+            cached.push_back(std::make_shared<CachedResult>());
+        }
+    }
+    return cached;
+}
+
+inline BehaviorNodeContainer instantiate_recurse(const Program& program, size_t index, CachedResults cached) {
+    auto& program_node = program.nodes[index];
+    cached = cached_results_of(program, index, std::move(cached));
+
+    std::vector<BehaviorNodeContainer> child_nodes;
+    child_nodes.reserve(program_node.children.size());
+    for (auto child : program_node.children) {
+        child_nodes.push_back(instantiate_recurse(program, child, cached));
+    }
+
+    return instantiate_node(program, index, std::move(child_nodes), cached);
+}
+
+/// Creates an instance of the node at `index` of the program with its descendants.
+inline BehaviorNodeContainer instantiate(const Program& program, size_t index = 0) {
+    return instantiate_recurse(program, index, {});
+}
+
+/// Instantiates a program a few nodes at a time, so that building a large tree
+/// can be spread over frames. It creates the same nodes as `instantiate()`.
+class InstanceBuilder {
+    struct Frame {
+        size_t index;
+        /// The next child in `ProgramNode::children` to build
+        size_t next_child = 0;
+        std::vector<BehaviorNodeContainer> child_nodes;
+        std::shared_ptr<const CachedResults> cached;
+    };
+
+    std::shared_ptr<const Program> program;
+    std::vector<Frame> stack;
+    std::optional<BehaviorNodeContainer> result;
+    size_t built = 0;
+
+    void push(size_t index, const std::shared_ptr<const CachedResults>& cached) {
+        Frame frame{ index, 0, {}, nullptr };
+        if (program->nodes[index].cse_slots) {
+            frame.cached = std::make_shared<const CachedResults>(cached_results_of(*program, index, {}));
+        }
+        else {
+            frame.cached = cached;
+        }
+        frame.child_nodes.reserve(program->nodes[index].children.size());
+        stack.push_back(std::move(frame));
+    }
+
+public:
+    explicit InstanceBuilder(std::shared_ptr<const Program> program, size_t index = 0) :
+        program(std::move(program))
+    {
+        push(index, std::make_shared<const CachedResults>());
+    }
+
+    /// Creates up to `max_nodes` more nodes and returns whether the instance is complete.
+    bool step(size_t max_nodes) {
+        while (!result && max_nodes) {
+            auto& frame = stack.back();
+            auto& children = program->nodes[frame.index].children;
+            if (frame.next_child < children.size()) {
+                auto child = children[frame.next_child++];
+                auto cached = frame.cached;
+                push(child, cached);
+                continue;
+            }
+            auto node = instantiate_node(*program, frame.index, std::move(frame.child_nodes), *frame.cached);
+            stack.pop_back();
+            built++;
+            max_nodes--;
+            if (stack.empty()) {
+                result = std::move(node);
+            }
+            else {
+                stack.back().child_nodes.push_back(std::move(node));
+            }
+        }
+        return result.has_value();
+    }
+
+    bool done() const {
+        return result.has_value();
+    }
+
+    /// The number of nodes created so far
+    size_t nodes_built() const {
+        return built;
+    }
+
+    /// Takes the complete instance. Call it only once `done()`.
+    BehaviorNodeContainer take() {
+        auto ret = std::move(*result);
+        result.reset();
+        return ret;
+    }
+};
+
+BehaviorNodeContainer load_recurse(
+    const TreeDef& parent,
+    const TreeSource& tree_source,
+    const Registry& registry,
+    const std::shared_ptr<const SourceMap>& source_map = nullptr
+) {
+    Program program;
+    std::unordered_map<const Tree*, size_t> subtree_bodies;
+    // The root of a tree is compiled with the ports of the tree, whose outputs its
+    // caller reads. Writes in any other node may be read outside of it, so none of
+    // them is eliminated.
+    auto tree = std::find_if(tree_source.begin(), tree_source.end(), [&parent](auto& tree) {
+        return &tree.node == &parent;
+    });
+    auto scope = tree != tree_source.end() ? compile_scope(parent, tree->ports, tree_source, registry)
+        : CompileScope::of(parent);
+    compile_recurse(program, parent, tree_source, registry, source_map, subtree_bodies, scope);
+    scope.assign_cse_slots(program, 0);
+    remove_unreachable_nodes(program);
+    return instantiate(program);
+}
+
+/// Instantiate a behavior tree from a AST of a tree.
+///
+/// `entry` is the name of the tree to instantiate. The compiled program of the tree is
+/// cached in `tree_source`, so loading the same entry again only creates the nodes.
+///
+/// `check_ports` enables static checking of port availability before actually ticking.
+/// It is useful to catch errors in a behavior tree source file, but you need to
+/// implement [`crate::BehaviorNode::provided_ports`] to use it.
+std::optional<BehaviorNodeContainer> load(
+    TreeSource& tree_source,
+    const Registry& registry,
+    std::string_view entry = "main"
+) {
+    auto program = tree_source.program(entry, registry);
+    if (!program) {
+        return std::nullopt;
+    }
+
+    return instantiate(*program);
+}
+
+/// Instantiate a behavior tree for an agent whose blackboard starts as `blackboard`.
+///
+/// The values of `Registry::constant_variables` in `blackboard` are folded into the
+/// program, see `compile()`. Agents with the same values share the program.
+inline std::optional<BehaviorNodeContainer> load(
+    TreeSource& tree_source,
+    const Registry& registry,
+    std::string_view entry,
+    const Blackboard& blackboard
+) {
+    Blackboard constants;
+    for (auto& name : registry.constant_variables) {
+        auto it = blackboard.find(name);
+        if (it != blackboard.end()) constants.insert(*it);
+    }
+    auto program = tree_source.program(entry, registry, constants);
+    if (!program) {
+        return std::nullopt;
+    }
+
+    return instantiate(*program);
+}
+
+/// The text of the `Condition` expression of the node, if it is given as a literal
+/// that `generate_native()` can compile.
+inline const std::string* native_expression(const ProgramNode& node) {
+    if (node.name != "Condition" || !node.factory) return nullptr;
+    auto it = node.blackboard_map.find("expr");
+    if (it == node.blackboard_map.end()) return nullptr;
+    auto text = std::get_if<1>(&it->second);
+    if (!text) return nullptr;
+    auto res = Expression::parse(*text);
+    auto expression = std::get_if<Expression>(&res);
+    if (!expression) return nullptr;
+    for (auto& node : expression->nodes) {
+        if (!std::isfinite(node.lhs.value) || !std::isfinite(node.rhs.value)) return nullptr;
+    }
+    return text;
+}
+
+/// A hash of what the code generated by `generate_native()` relies on: the names
+/// and the children of the nodes, the state machine tables and the expressions.
+inline uint64_t native_fingerprint(const Program& program) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto add = [&hash](std::string_view bytes) {
+        for (unsigned char c : bytes) {
+            hash = (hash ^ c) * 0x100000001b3ull;
+        }
+        hash = (hash ^ 0xff) * 0x100000001b3ull;
+    };
+    auto add_step = [&add](const FsmTable::Step& step) {
+        add(std::to_string(step.leaf) + to_string(step.result));
+    };
+    add(program.entry);
+    for (auto& node : program.nodes) {
+        add(node.name);
+        for (auto child : node.children) {
+            add(std::to_string(child));
+        }
+        if (auto text = native_expression(node)) add(*text);
+        if (node.fsm) {
+            add_step(node.fsm->start);
+            for (auto& step : node.fsm->transitions) {
+                add_step(step);
+            }
+            for (auto& guards : node.fsm->guards) {
+                for (auto& guard : guards) {
+                    add(std::to_string(guard.condition) + ':' + std::to_string(guard.branch));
+                    add_step(guard.enter[0]);
+                    add_step(guard.enter[1]);
+                    for (auto leaf : guard.halt) {
+                        add(std::to_string(leaf));
+                    }
+                }
+                add("");
+            }
+        }
+    }
+    return hash;
+}
+
+inline std::string cpp_string_literal(std::string_view text) {
+    std::string ret = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        }
+        else if (c < 0x20 || c >= 0x7f) {
+            char buf[8];
+            std::snprintf(buf, sizeof buf, "\\%03o", c);
+            ret += buf;
+        }
+        else {
+            ret += c;
+        }
+    }
+    return ret + "\"";
+}
+
+/// Writes the node of the expression as a C++ expression, with the variables
+/// looked up by their index in `names`.
+inline std::string native_expression_code(
+    const Expression& expression,
+    size_t index,
+    std::vector<std::string>& names
+) {
+    using Kind = Expression::Kind;
+    auto& node = expression.nodes[index];
+    auto operand = [&names](const Expression::Operand& operand) -> std::string {
+        if (operand.name.empty()) {
+            char buf[64];
+            std::snprintf(buf, sizeof buf, "(%a)", operand.value);
+            return buf;
+        }
+        auto it = std::find(names.begin(), names.end(), operand.name);
+        auto i = it - names.begin();
+        if (it == names.end()) names.push_back(operand.name);
+        return "lookup_number(ctx, names[" + std::to_string(i) + "])";
+    };
+    switch (node.kind) {
+        case Kind::Compare: {
+            if (node.op == CompareOp::Ne) {
+                return "std::islessgreater(" + operand(node.lhs) + ", " + operand(node.rhs) + ")";
+            }
+            static const char* ops[] = { "<", "<=", ">", ">=", "==" };
+            return "(" + operand(node.lhs) + " " + ops[static_cast<int>(node.op)] + " " + operand(node.rhs) + ")";
+        }
+        case Kind::Truthy:
+            return "std::islessgreater(" + operand(node.lhs) + ", 0.)";
+        case Kind::Const:
+            return node.lhs.value != 0. ? "true" : "false";
+        case Kind::Not:
+            return "!" + native_expression_code(expression, node.a, names);
+        case Kind::And:
+            return "(" + native_expression_code(expression, node.a, names) + " && "
+                + native_expression_code(expression, node.b, names) + ")";
+        case Kind::Or:
+            return "(" + native_expression_code(expression, node.a, names) + " || "
+                + native_expression_code(expression, node.b, names) + ")";
+    }
+    return "false";
+}
+
+/// Writes a `BehaviorNode` class doing what `FsmNode` does with the table, with
+/// the transitions as jumps between the ticks of the leaves. The leaves are ticked
+/// through `tick_leaf`, which `generate_native()` defines.
+inline void generate_native_fsm(std::ostream& os, const std::string& class_name, const FsmTable& table) {
+    auto result = [](BehaviorResult result) {
+        return std::string("BehaviorResult::") + to_string(result);
+    };
+    auto step = [&result](const FsmTable::Step& step) {
+        if (step.leaf >= 0) return "goto leaf_" + std::to_string(step.leaf) + ";";
+        return "{ result = " + result(step.result) + "; goto done; }";
+    };
+    os << "class " << class_name << " final : public BehaviorNode {\n"
+        << "    int resume = -1;\n"
+        << "public:\n"
+        << "    BehaviorResult tick(Context& context) override {\n"
+        << "        auto& leaves = *context.child_nodes;\n"
+        << "        BehaviorResult res, result;\n"
+        << "        int last = -1;\n"
+        << "        switch (resume) {\n";
+    for (size_t leaf = 0; leaf < table.guards.size(); leaf++) {
+        os << "        case " << leaf << ": goto resume_" << leaf << ";\n";
+    }
+    os << "        default: break;\n"
+        << "        }\n"
+        << "        " << step(table.start) << "\n";
+    for (size_t leaf = 0; leaf < table.guards.size(); leaf++) {
+        os << "    resume_" << leaf << ":\n";
+        for (auto& guard : table.guards[leaf]) {
+            os << "        res = tick_leaf(leaves[" << guard.condition << "], context);\n"
+                << "        if (res " << (guard.branch == 1 ? "==" : "!=") << " BehaviorResult::Fail) {\n";
+            for (auto halt : guard.halt) {
+                os << "            leaves[" << halt << "].halt();\n";
+            }
+            os << "            " << step(guard.enter[guard.branch == 1 ? 1 : 0]) << "\n"
+                << "        }\n";
+        }
+        os << "        goto leaf_" << leaf << ";\n";
+    }
+    for (size_t leaf = 0; leaf < table.guards.size(); leaf++) {
+        os << "    leaf_" << leaf << ":\n"
+            << "        last = " << leaf << ";\n"
+            << "        res = tick_leaf(leaves[" << leaf << "], context);\n";
+        for (auto res : { BehaviorResult::Success, BehaviorResult::Fail }) {
+            os << "        if (res == " << result(res) << ") "
+                << step(table.transitions[leaf * 3 + static_cast<int>(res)]) << "\n";
+        }
+        os << "        " << step(table.transitions[leaf * 3 + static_cast<int>(BehaviorResult::Running)]) << "\n";
+    }
+    os << "    done:\n"
+        << "        resume = result == BehaviorResult::Running ? last : -1;\n"
+        << "        return result;\n"
+        << "    }\n"
+        << "    void halt() override {\n"
+        << "        resume = -1;\n"
+        << "    }\n"
+        << "    std::string state() const override {\n"
+        << "        return \"resume=\" + std::to_string(resume);\n"
+        << "    }\n"
+        << "};\n\n";
+}
+
+/// Generates a C++ translation unit with the nodes of the programs that can be
+/// compiled natively: the `FsmNode`s of `lower_fsm()` and the `Condition`s with
+/// literal expressions. The other nodes are left to the interpreter. `header` is
+/// the path of this header to include. See `NativeLibrary`.
+///
+/// The shared object exports `btl_entry_names()`, which returns the entry names
+/// terminated by nullptr, and `btl_build_program(entry, program, native)`, which
+/// replaces the factories of the native nodes in a program compiled from the same
+/// source and appends their indices to `native`, or returns false if its
+/// `native_fingerprint()` differs. It also exports `btl_set_tick(tick)`, with which
+/// the host ticks the leaves of the native nodes, so that they are ticked with the
+/// statics of the host, such as the state of `SamplingProfiler`.
+inline void generate_native(
+    std::ostream& os,
+    const std::vector<std::shared_ptr<const Program>>& programs,
+    std::string_view header
+) {
+    os << "// Generated by behavior_tree_lite::generate_native()\n"
+        << "#include " << cpp_string_literal(header) << "\n"
+        << "#include <cstring>\n\n"
+        << "using namespace behavior_tree_lite;\n\n"
+        << "namespace {\n\n"
+        << "BehaviorResult (*tick_leaf)(BehaviorNodeContainer&, Context&) =\n"
+        << "    [](BehaviorNodeContainer& node, Context& context) { return node.tick(context); };\n\n";
+    std::vector<std::vector<std::pair<size_t, std::string>>> classes(programs.size());
+    for (size_t p = 0; p < programs.size(); p++) {
+        auto& nodes = programs[p]->nodes;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            auto class_name = "Node_" + std::to_string(p) + "_" + std::to_string(i);
+            if (nodes[i].fsm) {
+                generate_native_fsm(os, class_name, *nodes[i].fsm);
+            }
+            else if (auto text = native_expression(nodes[i])) {
+                auto expression = std::get<Expression>(Expression::parse(*text));
+                std::vector<std::string> names;
+                auto code = native_expression_code(expression, expression.nodes.size() - 1, names);
+                os << "class " << class_name << " final : public NativeCondition {\n";
+                if (!names.empty()) {
+                    os << "    static inline const std::string names[] = {";
+                    for (auto& name : names) {
+                        os << " " << cpp_string_literal(name) << ",";
+                    }
+                    os << " };\n";
+                }
+                os << "public:\n"
+                    << "    " << class_name << "() : NativeCondition(" << cpp_string_literal(*text) << ") {}\n"
+                    << "    bool evaluate(Context& ctx) override {\n"
+                    << "        return " << code << ";\n"
+                    << "    }\n"
+                    << "};\n\n";
+            }
+            else {
+                continue;
+            }
+            classes[p].emplace_back(i, class_name);
         }
-        throw write_to_literal_error{};
     }
+    os << "const char* const entry_names[] = {";
+    for (auto& program : programs) {
+        os << " " << cpp_string_literal(program->entry) << ",";
+    }
+    os << " nullptr };\n\n"
+        << "} // namespace\n\n"
+        << "#define BTL_EXPORT extern \"C\" __attribute__((visibility(\"default\")))\n\n"
+        << "BTL_EXPORT const char* const* btl_entry_names() {\n"
+        << "    return entry_names;\n"
+        << "}\n\n"
+        << "BTL_EXPORT void btl_set_tick(BehaviorResult (*tick)(BehaviorNodeContainer&, Context&)) {\n"
+        << "    tick_leaf = tick;\n"
+        << "}\n\n"
+        << "BTL_EXPORT bool btl_build_program(const char* entry, Program* program, std::vector<size_t>* native) {\n";
+    for (size_t p = 0; p < programs.size(); p++) {
+        char fingerprint[32];
+        std::snprintf(fingerprint, sizeof fingerprint, "0x%016llxull",
+            static_cast<unsigned long long>(native_fingerprint(*programs[p])));
+        os << "    if (!std::strcmp(entry, " << cpp_string_literal(programs[p]->entry) << ")) {\n"
+            << "        if (native_fingerprint(*program) != " << fingerprint << ") return false;\n";
+        for (auto& [index, class_name] : classes[p]) {
+            os << "        program->nodes[" << index << "].factory = []() {\n"
+                << "            return std::unique_ptr<BehaviorNode>(new " << class_name << "());\n"
+                << "        };\n"
+                << "        native->push_back(" << index << ");\n";
+        }
+        os << "        return true;\n"
+            << "    }\n";
+    }
+    os << "    return false;\n"
+        << "}\n";
+}
 
-    std::optional<BehaviorResult> tick_child(int idx);
+#if BEHAVIOR_TREE_LITE_POSIX
+/// How `NativeLibrary::compile()` runs the compiler.
+struct NativeOptions {
+    /// The compiler command, run through the shell
+    std::string compiler = "c++";
+    /// `-fno-gnu-unique` keeps GCC from marking the inline statics of this header as
+    /// unique symbols, which would prevent the library from being unloaded. Remove
+    /// it for compilers that do not know it.
+    std::string flags = "-std=c++17 -O2 -fno-gnu-unique";
+    /// The path of this header, which the generated code includes. It must be given,
+    /// since the path the host was compiled with is relative to the directory it was
+    /// built in. A relative path is resolved against the current directory.
+    std::string header;
+    /// Where the private directory of the generated files is created, or the temporary
+    /// directory if empty. It is removed once the library is loaded.
+    std::string directory;
 };
 
-struct BehaviorNodeContainer {
-    /// Name of the type of the node
-    std::string name;
-protected:
-    std::unique_ptr<BehaviorNode> node;
-    BBMap blackboard_map;
-    std::vector<BehaviorNodeContainer> child_nodes;
+/// A shared object with the nodes generated by `generate_native()`.
+///
+/// The library is unloaded when this object, the programs built from it and the
+/// nodes they created are all destroyed, so reloading trees does not accumulate
+/// libraries. The library has its own copies of the statics of this header, so the
+/// leaves of its nodes are ticked by the host, which keeps them in the samples of
+/// `SamplingProfiler`.
+class NativeLibrary {
+    using EntryNames = const char* const* (*)();
+    using BuildProgram = bool (*)(const char*, Program*, std::vector<size_t>*);
+    using SetTick = void (*)(BehaviorResult (*)(BehaviorNodeContainer&, Context&));
+    /// The handle of `dlopen()`, closed with the last reference
+    std::shared_ptr<void> handle;
+    EntryNames entry_names;
+    BuildProgram build_program;
+
+    NativeLibrary(std::shared_ptr<void> handle, EntryNames entry_names, BuildProgram build_program) :
+        handle(std::move(handle)), entry_names(entry_names), build_program(build_program) {}
+
+    /// A node created by the library, which keeps it loaded. The node is destroyed
+    /// before the reference, since its destructor is in the library.
+    class LoadedNode : public BehaviorNode {
+        std::shared_ptr<void> library;
+        std::unique_ptr<BehaviorNode> node;
+
+    public:
+        LoadedNode(std::shared_ptr<void> library, std::unique_ptr<BehaviorNode> node) :
+            library(std::move(library)), node(std::move(node)) {}
+
+        BehaviorResult tick(Context& context) override {
+            return node->tick(context);
+        }
+
+        void halt() override {
+            node->halt();
+        }
+
+        std::string state() const override {
+            return node->state();
+        }
+    };
+
+    /// A factory of the library wrapped in `LoadedNode`s. Like the nodes, the
+    /// factory is destroyed before the reference.
+    struct LoadedFactory {
+        std::shared_ptr<void> library;
+        std::function<std::unique_ptr<BehaviorNode> ()> factory;
+
+        std::unique_ptr<BehaviorNode> operator()() const {
+            return std::make_unique<LoadedNode>(library, factory());
+        }
+    };
 
 public:
-    BehaviorNodeContainer(
-        std::string name,
-        std::unique_ptr<BehaviorNode> node,
-        BBMap bbmap,
-        std::vector<BehaviorNodeContainer> child_nodes
-    ) : name(name),
-        node(std::move(node)),
-        blackboard_map(std::move(bbmap)),
-        child_nodes(std::move(child_nodes)) { }
+    /// Loads a shared object. Throws `native_compile_error` if it cannot be loaded
+    /// or does not export the functions of `generate_native()`.
+    static std::shared_ptr<const NativeLibrary> open(const std::string& path) {
+        auto raw = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!raw) throw native_compile_error(dlerror());
+        std::shared_ptr<void> handle(raw, [](void* handle) { dlclose(handle); });
+        auto entry_names = reinterpret_cast<EntryNames>(dlsym(raw, "btl_entry_names"));
+        auto build_program = reinterpret_cast<BuildProgram>(dlsym(raw, "btl_build_program"));
+        auto set_tick = reinterpret_cast<SetTick>(dlsym(raw, "btl_set_tick"));
+        if (!entry_names || !build_program || !set_tick) {
+            throw native_compile_error(path + " is not generated by generate_native()");
+        }
+        set_tick([](BehaviorNodeContainer& node, Context& context) { return node.tick(context); });
+        return std::shared_ptr<const NativeLibrary>(new NativeLibrary(std::move(handle), entry_names, build_program));
+    }
 
-    BehaviorResult tick(Context& context) {
-        if (this->node) {
-            auto prev_child_node = context.child_nodes;
-            context.child_nodes = &this->child_nodes;
-            auto prev_blackboard_map = context.blackboard_map;
-            context.blackboard_map = &this->blackboard_map;
-            BehaviorResult res;
-            try {
-                res = this->node->tick(context);
+    /// Generates the code of the programs, compiles it into a shared object and
+    /// loads it. Throws `native_compile_error` with the output of the compiler if
+    /// it fails, or if `NativeOptions::header` is not a file.
+    static std::shared_ptr<const NativeLibrary> compile(
+        const std::vector<std::shared_ptr<const Program>>& programs,
+        const NativeOptions& options
+    ) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        if (options.header.empty() || !fs::is_regular_file(options.header, ec)) {
+            throw native_compile_error("NativeOptions::header is not the path of behavior_tree_lite.h: \""
+                + options.header + "\"");
+        }
+        // A private directory, so that other users cannot replace the shared object
+        // before it is loaded
+        auto parent = options.directory.empty() ? fs::temp_directory_path() : fs::path(options.directory);
+        auto pattern = (parent / "btl_native_XXXXXX").string();
+        if (!mkdtemp(pattern.data())) {
+            throw native_compile_error("Cannot create a directory in " + parent.string() + ": " + std::strerror(errno));
+        }
+        fs::path directory = pattern;
+        auto source = (directory / "tree.cc").string();
+        auto object = (directory / "tree.so").string();
+        auto log = (directory / "compile.log").string();
+        auto cleanup = [&directory]() {
+            std::error_code ec;
+            fs::remove_all(directory, ec);
+        };
+        {
+            std::ofstream os(source);
+            generate_native(os, programs, fs::absolute(options.header).string());
+            if (!os) {
+                cleanup();
+                throw native_compile_error("Cannot write " + source);
             }
-            catch (std::exception &e) {
-                context.child_nodes = prev_child_node;
-                context.blackboard_map = prev_blackboard_map;
-                throw;
+        }
+        auto quote = [](const std::string& path) {
+            std::string ret = "'";
+            for (auto c : path) {
+                if (c == '\'') ret += "'\\''";
+                else ret += c;
             }
-            context.child_nodes = prev_child_node;
-            context.blackboard_map = prev_blackboard_map;
-            return res;
+            return ret + "'";
+        };
+        auto command = options.compiler + " " + options.flags + " -shared -fPIC -o " + quote(object)
+            + " " + quote(source) + " > " + quote(log) + " 2>&1";
+        auto status = std::system(command.c_str());
+        if (status != 0) {
+            std::ifstream is(log);
+            std::stringstream output;
+            output << is.rdbuf();
+            cleanup();
+            throw native_compile_error("Compiling " + source + " failed:\n" + output.str());
+        }
+        try {
+            auto ret = open(object);
+            cleanup();
+            return ret;
+        }
+        catch (...) {
+            cleanup();
+            throw;
         }
-        return BehaviorResult::Success;
     }
 
-    const std::vector<BehaviorNodeContainer>& get_child_nodes() const {
-        return child_nodes;
+    std::vector<std::string> entries() const {
+        std::vector<std::string> ret;
+        for (auto name = entry_names(); *name; name++) {
+            ret.emplace_back(*name);
+        }
+        return ret;
+    }
+
+    /// Returns a copy of the program with the native nodes, or nullptr if the
+    /// library was not generated from the same program.
+    std::shared_ptr<const Program> build(const Program& program) const {
+        auto ret = std::make_shared<Program>(program);
+        std::vector<size_t> native;
+        if (!build_program(program.entry.c_str(), ret.get(), &native)) return nullptr;
+        for (auto index : native) {
+            auto& factory = ret->nodes[index].factory;
+            factory = LoadedFactory{ handle, std::move(factory) };
+        }
+        return ret;
     }
 };
+#endif
 
-inline std::optional<BehaviorResult> Context::tick_child(int idx) {
-    auto children = this->child_nodes;
-    if (children->size() <= idx) return std::nullopt;
-    auto& child = (*children)[idx];
-    return child.tick(*this);
-}
+/// A set of compiled programs keyed by the entry name, which can be updated
+/// while other threads spawn agents from it.
+///
+/// The programs are kept in an immutable map that is replaced atomically on every
+/// update, so spawning never waits for a compilation. Agents already spawned keep
+/// the program they were instantiated from.
+class TreeLibrary {
+    using Programs = std::unordered_map<std::string, std::shared_ptr<const Program>>;
+    std::shared_ptr<const Programs> programs = std::make_shared<const Programs>();
+    /// Serializes the updates, not the reads
+    std::mutex update_mutex;
+    BoundedQueue<std::packaged_task<std::vector<std::string> ()>> jobs{SIZE_MAX};
+    std::thread worker;
 
-class SequenceNode : public BehaviorNode {
-    int current_child = 0;
-    BehaviorResult tick(Context& context) override {
-        BehaviorResult result = BehaviorResult::Success;
-        while (current_child < context.child_nodes->size()) {
-            result = (*context.child_nodes)[current_child].tick(context);
-            bool break_out = false;
-            switch (result) {
-                case BehaviorResult::Success: current_child++; break;
-                case BehaviorResult::Fail: current_child++; break_out = true; break;
-                case BehaviorResult::Running: break_out = true; break;
-            }
-            if (break_out) break;
-        }
-        if (current_child == context.child_nodes->size()) {
-            current_child = 0;
+public:
+    TreeLibrary() : worker([this]{
+        while (auto job = jobs.pop()) {
+            (*job)();
         }
+    }) {}
 
-        return result;
+    /// Waits for the queued compilations to finish.
+    ~TreeLibrary() {
+        jobs.close();
+        worker.join();
     }
-};
 
-class ReactiveSequenceNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        int current_child = 0;
-        BehaviorResult result = BehaviorResult::Success;
-        while (current_child < context.child_nodes->size()) {
-            result = (*context.child_nodes)[current_child].tick(context);
-            bool break_out = false;
-            switch (result) {
-                case BehaviorResult::Success: current_child++; break;
-                case BehaviorResult::Fail: current_child++; break_out = true; break;
-                case BehaviorResult::Running: break_out = true; break;
+    TreeLibrary(const TreeLibrary&) = delete;
+    TreeLibrary& operator=(const TreeLibrary&) = delete;
+
+    /// Returns the current program of the entry, or nullptr.
+    std::shared_ptr<const Program> program(std::string_view entry) const {
+        auto current = std::atomic_load(&programs);
+        auto it = current->find(std::string(entry));
+        if (it == current->end()) return nullptr;
+        return it->second;
+    }
+
+    /// Instantiates the current program of the entry.
+    std::optional<BehaviorNodeContainer> spawn(std::string_view entry) const {
+        auto entry_program = program(entry);
+        if (!entry_program) return std::nullopt;
+        return instantiate(*entry_program);
+    }
+
+    /// Replaces the programs with the same entry names and adds the others,
+    /// all in one atomic step.
+    void publish(const std::vector<std::shared_ptr<const Program>>& new_programs) {
+        std::lock_guard lock(update_mutex);
+        auto next = std::make_shared<Programs>(*std::atomic_load(&programs));
+        for (auto& new_program : new_programs) {
+            (*next)[new_program->entry] = new_program;
+        }
+        std::atomic_store(&programs, std::shared_ptr<const Programs>(std::move(next)));
+    }
+
+    /// Compiles the `entries` of the source, or all of its trees if `entries` is empty,
+    /// and publishes them. Nothing is published if any of them fails to compile.
+    /// Returns the names of the published entries.
+    std::vector<std::string> publish(
+        const TreeSource& source,
+        const Registry& registry,
+        std::vector<std::string> entries = {}
+    ) {
+        if (entries.empty()) {
+            for (auto& tree : source) {
+                entries.push_back(tree.name);
             }
-            if (break_out) break;
         }
+        std::vector<std::shared_ptr<const Program>> new_programs;
+        for (auto& entry : entries) {
+            auto new_program = compile(source, registry, entry);
+            if (!new_program) {
+                throw undefined_tree_error{entry};
+            }
+            new_programs.push_back(std::move(new_program));
+        }
+        publish(new_programs);
+        return entries;
+    }
 
-        return result;
+    /// Parses, compiles and publishes a source text on the background thread.
+    /// The future throws `parse_error` or the error of the loader if it fails.
+    std::future<std::vector<std::string>> compile_async(
+        std::string text,
+        Registry registry,
+        std::string file_name = "",
+        std::vector<std::string> entries = {}
+    ) {
+        std::packaged_task<std::vector<std::string> ()> job(
+            [this, text = std::move(text), registry = std::move(registry),
+                file_name = std::move(file_name), entries = std::move(entries)]() mutable
+        {
+            auto res = source_text(text, std::move(file_name));
+            if (auto e = std::get_if<1>(&res)) {
+                throw parse_error(*e);
+            }
+            return publish(std::get<0>(res).second, registry, std::move(entries));
+        });
+        auto ret = job.get_future();
+        jobs.push(std::move(job));
+        return ret;
+    }
+
+#if BEHAVIOR_TREE_LITE_POSIX
+    /// Publishes the interpreted programs of the source at once, and compiles them to
+    /// native code on the background thread, see `NativeLibrary`. Each native program
+    /// replaces the interpreted one, unless it was replaced by another in the meantime.
+    /// Returns the names of the entries published natively. The future throws
+    /// `native_compile_error` if the compilation fails, and the interpreted programs
+    /// stay in use.
+    std::future<std::vector<std::string>> compile_native_async(
+        const TreeSource& source,
+        const Registry& registry,
+        NativeOptions options,
+        std::vector<std::string> entries = {}
+    ) {
+        std::vector<std::shared_ptr<const Program>> interpreted;
+        for (auto& entry : publish(source, registry, std::move(entries))) {
+            interpreted.push_back(program(entry));
+        }
+        std::packaged_task<std::vector<std::string> ()> job(
+            [this, interpreted = std::move(interpreted), options = std::move(options)]()
+        {
+            auto library = NativeLibrary::compile(interpreted, options);
+            std::vector<std::string> ret;
+            std::lock_guard lock(update_mutex);
+            auto next = std::make_shared<Programs>(*std::atomic_load(&programs));
+            for (auto& program : interpreted) {
+                auto it = next->find(program->entry);
+                if (it == next->end() || it->second != program) continue;
+                if (auto native = library->build(*program)) {
+                    it->second = std::move(native);
+                    ret.push_back(program->entry);
+                }
+            }
+            std::atomic_store(&programs, std::shared_ptr<const Programs>(std::move(next)));
+            return ret;
+        });
+        auto ret = job.get_future();
+        jobs.push(std::move(job));
+        return ret;
     }
+#endif
 };
 
-class FallbackNode : public BehaviorNode {
-    int current_child = 0;
-    BehaviorResult tick(Context& context) override {
-        BehaviorResult result = BehaviorResult::Fail;
-        while (current_child < context.child_nodes->size()) {
-            result = (*context.child_nodes)[current_child].tick(context);
-            bool break_out = false;
-            switch (result) {
-                case BehaviorResult::Success: current_child++; break_out = true; break;
-                case BehaviorResult::Fail: current_child++; break;
-                case BehaviorResult::Running: break_out = true; break;
+BehaviorResult tick_node(BehaviorNodeContainer& node, Blackboard &bb) {
+    Context context { .blackboard = bb };
+    context.generation = new_generation();
+    return node.tick(context);
+}
+
+/// Writes the node and its descendants as they are now: the name, the state of
+/// the node, the result of its last tick and the location in the source text.
+inline void write_json(JsonWriter& json, const BehaviorNodeContainer& node) {
+    json.begin_object();
+    json.key("name").value(node.name);
+    if (auto loc = node.location()) {
+        json.key("line").value(uint64_t(loc->line));
+        json.key("column").value(uint64_t(loc->column));
+    }
+    if (node.get_node()) {
+        auto state = node.get_node()->state();
+        if (!state.empty()) json.key("state").value(state);
+    }
+    json.key("last_result");
+    if (node.last_result) json.value(to_string(*node.last_result));
+    else json.null();
+    json.key("children").begin_array();
+    for (auto& child : node.get_child_nodes()) {
+        write_json(json, child);
+    }
+    json.end_array();
+    json.end_object();
+}
+
+inline void write_json(JsonWriter& json, const Blackboard& blackboard) {
+    json.begin_object();
+    for (auto& [name, value] : blackboard) {
+        json.key(name).value(value);
+    }
+    json.end_object();
+}
+
+/// A copy of a blackboard that one thread publishes and other threads read
+/// without locks, for example a debug UI observing an agent ticked by the
+/// simulation thread.
+///
+/// It is a seqlock: `publish()` makes the version odd while it writes the words
+/// of the buffer and even again afterwards, and a reader retries if the version
+/// changed while it copied the words. Readers never block the writer. The buffer
+/// has a fixed capacity, so that readers never see it reallocated.
+class SeqlockBlackboard {
+    std::atomic<uint64_t> sequence{0};
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    size_t capacity;
+    /// The encoding of the blackboard being published, kept to reuse its memory
+    std::string scratch;
+
+    static void put_size(std::string& buf, size_t size) {
+        uint32_t n = static_cast<uint32_t>(size);
+        buf.append(reinterpret_cast<const char*>(&n), sizeof n);
+    }
+
+    static void put_string(std::string& buf, std::string_view s) {
+        put_size(buf, s.size());
+        buf.append(s);
+    }
+
+    static size_t get_size(std::string_view buf, size_t& pos) {
+        uint32_t n;
+        std::memcpy(&n, buf.data() + pos, sizeof n);
+        pos += sizeof n;
+        return n;
+    }
+
+    static std::string_view get_string(std::string_view buf, size_t& pos) {
+        auto size = get_size(buf, pos);
+        auto ret = buf.substr(pos, size);
+        pos += size;
+        return ret;
+    }
+
+    /// Copies a consistent encoding of the last published blackboard into `buf`
+    /// and returns its version.
+    uint64_t copy(std::string& buf) const {
+        while (true) {
+            auto begin = sequence.load(std::memory_order_acquire);
+            if (begin & 1) {
+                std::this_thread::yield();
+                continue;
             }
-            if (break_out) {
-                current_child++;
-                break;
+            auto size = words[0].load(std::memory_order_relaxed);
+            if (size <= capacity * sizeof(uint64_t)) {
+                buf.resize((size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t));
+                for (size_t i = 0; i < buf.size() / sizeof(uint64_t); i++) {
+                    auto word = words[i + 1].load(std::memory_order_relaxed);
+                    std::memcpy(&buf[i * sizeof(uint64_t)], &word, sizeof word);
+                }
+                buf.resize(size);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == begin) {
+                return begin / 2;
             }
         }
-        if (current_child == context.child_nodes->size()) {
-            current_child = 0;
+    }
+
+public:
+    /// Makes a buffer of `capacity` bytes for the names and values of the variables.
+    explicit SeqlockBlackboard(size_t capacity = 4096) :
+        capacity(std::max<size_t>(1, (capacity + sizeof(uint64_t) - 1) / sizeof(uint64_t)))
+    {
+        words.reset(new std::atomic<uint64_t>[this->capacity + 1]);
+        // The encoding of an empty blackboard
+        words[0].store(sizeof(uint32_t), std::memory_order_relaxed);
+        words[1].store(0, std::memory_order_relaxed);
+    }
+
+    /// Makes a copy of the blackboard visible to the readers. Only one thread may
+    /// publish. Returns false and keeps the previous copy if the blackboard does not
+    /// fit in the buffer.
+    bool publish(const Blackboard& blackboard) {
+        scratch.clear();
+        put_size(scratch, blackboard.size());
+        for (auto& [name, value] : blackboard) {
+            put_string(scratch, name);
+            put_string(scratch, value);
         }
+        if (capacity * sizeof(uint64_t) < scratch.size()) return false;
+        auto seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        words[0].store(scratch.size(), std::memory_order_relaxed);
+        scratch.resize((scratch.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t));
+        for (size_t i = 0; i < scratch.size() / sizeof(uint64_t); i++) {
+            uint64_t word;
+            std::memcpy(&word, &scratch[i * sizeof(uint64_t)], sizeof word);
+            words[i + 1].store(word, std::memory_order_relaxed);
+        }
+        sequence.store(seq + 2, std::memory_order_release);
+        return true;
+    }
 
-        return result;
+    /// The number of times the blackboard was published.
+    uint64_t version() const {
+        return sequence.load(std::memory_order_acquire) / 2;
     }
-};
 
-class ReactiveFallbackNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        BehaviorResult result = BehaviorResult::Fail;
-        int current_child = 0;
-        while (current_child < context.child_nodes->size()) {
-            result = (*context.child_nodes)[current_child].tick(context);
-            bool break_out = false;
-            switch (result) {
-                case BehaviorResult::Success: current_child++; break_out = true; break;
-                case BehaviorResult::Fail: current_child++; break;
-                case BehaviorResult::Running: break_out = true; break;
-            }
-            if (break_out) {
-                current_child++;
-                break;
-            }
+    /// Returns a copy of the last published blackboard. Any thread may read.
+    Blackboard read(uint64_t* version = nullptr) const {
+        std::string buf;
+        auto v = copy(buf);
+        if (version) *version = v;
+        Blackboard ret;
+        size_t pos = 0;
+        auto count = get_size(buf, pos);
+        for (size_t i = 0; i < count; i++) {
+            auto name = get_string(buf, pos);
+            ret.emplace(name, get_string(buf, pos));
         }
+        return ret;
+    }
 
-        return result;
+    /// Returns the values of the named variables in the last published blackboard,
+    /// or nullopt for the variables it does not have.
+    std::vector<std::optional<std::string>> read(const std::vector<std::string>& names,
+        uint64_t* version = nullptr) const
+    {
+        std::string buf;
+        auto v = copy(buf);
+        if (version) *version = v;
+        std::vector<std::optional<std::string>> ret(names.size());
+        size_t pos = 0;
+        auto count = get_size(buf, pos);
+        for (size_t i = 0; i < count; i++) {
+            auto name = get_string(buf, pos);
+            auto value = get_string(buf, pos);
+            for (size_t j = 0; j < names.size(); j++) {
+                if (names[j] == name) ret[j] = std::string(value);
+            }
+        }
+        return ret;
     }
 };
 
-class ForceSuccessNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        auto first = context.child_nodes->begin();
-        if (first != context.child_nodes->end()) {
-            auto result = first->tick(context);
-            switch (result) {
-                case BehaviorResult::Running: return BehaviorResult::Running;
-            }
+/// Escapes the characters that separate the fields and the lines of a snapshot.
+inline std::string escape_snapshot_field(std::string_view s) {
+    std::string ret;
+    ret.reserve(s.size());
+    for (auto c : s) {
+        switch (c) {
+            case '\\': ret += "\\\\"; break;
+            case '\t': ret += "\\t"; break;
+            case '\n': ret += "\\n"; break;
+            default: ret += c;
         }
+    }
+    return ret;
+}
 
-        return BehaviorResult::Success;
+/// Writes a line `node <depth> <name> <state>` for the node and each of its
+/// descendants in preorder.
+inline void write_snapshot(std::ostream& os, const BehaviorNodeContainer& node, size_t depth = 0) {
+    os << "node\t" << depth << "\t" << escape_snapshot_field(node.name) << "\t"
+        << escape_snapshot_field(node.get_node() ? node.get_node()->state() : "") << "\n";
+    for (auto& child : node.get_child_nodes()) {
+        write_snapshot(os, child, depth + 1);
     }
-};
+}
 
-class ForceFailureNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        auto first = context.child_nodes->begin();
-        if (first != context.child_nodes->end()) {
-            auto result = first->tick(context);
-            switch (result) {
-                case BehaviorResult::Running: return BehaviorResult::Running;
+/// Ticks a population of agents.
+///
+/// The values the application feeds to all agents each frame can be kept in the
+/// shared `columns()`, where each agent reads its own row.
+class Executor {
+public:
+    struct Agent {
+        BehaviorNodeContainer tree;
+        /// Holds the agent's own blackboard and user data
+        Context context;
+        BehaviorResult last_result = BehaviorResult::Running;
+        /// Where the blackboard is published after each tick, see `observe()`
+        std::shared_ptr<SeqlockBlackboard> observer;
+    };
+
+private:
+    std::vector<Agent> agents;
+    ColumnBlackboard column_blackboard;
+    BatchConditions batch_conditions;
+    bool batch_enabled = false;
+
+    /// An agent being instantiated by `build_spawns()`
+    struct PendingSpawn {
+        InstanceBuilder builder;
+        Blackboard blackboard;
+        std::function<void (size_t)> on_spawn;
+    };
+    std::deque<PendingSpawn> spawn_queue;
+    size_t spawn_node_budget = std::numeric_limits<size_t>::max();
+    std::chrono::nanoseconds spawn_time_budget = std::chrono::nanoseconds::max();
+
+public:
+    /// Adds an agent and returns its index, which is also its row in the columns.
+    /// Throws `column_capacity_error` if an attached column has no room for it.
+    size_t spawn(BehaviorNodeContainer tree, Blackboard blackboard = {}) {
+        column_blackboard.resize(agents.size() + 1);
+        agents.push_back(Agent {
+            .tree = std::move(tree),
+            .context = Context { .blackboard = std::move(blackboard) },
+            .observer = nullptr,
+        });
+        return agents.size() - 1;
+    }
+
+    /// Queues an agent to be instantiated over the next frames within the budget
+    /// given by `set_spawn_budget()`. It is added when its tree is complete, at the
+    /// start of a `tick()`, and `on_spawn` is called with its index.
+    void enqueue_spawn(
+        std::shared_ptr<const Program> program,
+        Blackboard blackboard = {},
+        std::function<void (size_t)> on_spawn = {}
+    ) {
+        spawn_queue.push_back(PendingSpawn{
+            .builder = InstanceBuilder(std::move(program)),
+            .blackboard = std::move(blackboard),
+            .on_spawn = std::move(on_spawn),
+        });
+    }
+
+    /// Limits the nodes instantiated and the time spent on the queued spawns in a frame.
+    /// At least one node is instantiated per frame while any spawn is queued.
+    void set_spawn_budget(size_t nodes, std::chrono::nanoseconds time = std::chrono::nanoseconds::max()) {
+        spawn_node_budget = std::max<size_t>(1, nodes);
+        spawn_time_budget = time;
+    }
+
+    /// The number of queued agents not added yet
+    size_t pending_spawns() const {
+        return spawn_queue.size();
+    }
+
+    /// Continues instantiating the queued agents within the budget of a frame and
+    /// adds the complete ones. Returns the number of agents added. `tick()` calls it.
+    size_t build_spawns() {
+        // The clock is read once per this many nodes
+        constexpr size_t chunk = 32;
+        auto start = std::chrono::steady_clock::now();
+        auto nodes = spawn_node_budget;
+        size_t added = 0;
+        while (!spawn_queue.empty() && nodes) {
+            auto& pending = spawn_queue.front();
+            auto before = pending.builder.nodes_built();
+            auto done = pending.builder.step(std::min(nodes, chunk));
+            nodes -= pending.builder.nodes_built() - before;
+            if (done) {
+                auto index = spawn(pending.builder.take(), std::move(pending.blackboard));
+                auto on_spawn = std::move(pending.on_spawn);
+                spawn_queue.pop_front();
+                added++;
+                if (on_spawn) on_spawn(index);
+            }
+            if (spawn_time_budget != std::chrono::nanoseconds::max()
+                && spawn_time_budget <= std::chrono::steady_clock::now() - start)
+            {
+                break;
             }
         }
+        return added;
+    }
 
-        return BehaviorResult::Fail;
+    size_t size() const {
+        return agents.size();
     }
-};
 
-class InverterNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        BehaviorResult result = BehaviorResult::Fail;
-        const auto child = context.child_nodes->begin();
-        if (child != context.child_nodes->end()) {
-            result = child->tick(context);
-            switch (result) {
-                case BehaviorResult::Success: result = BehaviorResult::Fail; break;
-                case BehaviorResult::Fail: result = BehaviorResult::Success; break;
-            }
+    Agent& agent(size_t index) {
+        return agents[index];
+    }
+
+    const Agent& agent(size_t index) const {
+        return agents[index];
+    }
+
+    ColumnBlackboard& columns() {
+        return column_blackboard;
+    }
+
+    /// Writes a value per agent into the column of the variable, in the order of
+    /// the agent indices. See `ColumnBlackboard::ingest()`.
+    template<typename T>
+    void ingest(const std::string& name, const T* values, size_t count) {
+        column_blackboard.ingest(name, values, count);
+    }
+
+    /// Enables evaluating the `Condition` nodes and the scores of the `UtilitySelector`
+    /// nodes of all agents at once at the start of each frame. The nodes then see the
+    /// columns as they were at the start of the frame, and variables outside the
+    /// columns fall back to evaluation per agent.
+    void set_batch_conditions(bool enabled) {
+        batch_enabled = enabled;
+    }
+
+    const BatchConditions& conditions() const {
+        return batch_conditions;
+    }
+
+    BehaviorResult tick_agent(size_t index) {
+        auto& agent = agents[index];
+        agent.context.columns = &column_blackboard;
+        agent.context.row = index;
+        agent.context.batch = batch_enabled ? &batch_conditions : nullptr;
+        agent.context.generation = new_generation();
+        agent.last_result = agent.tree.tick(agent.context);
+        if (agent.observer) {
+            agent.observer->publish(agent.context.blackboard);
         }
+        return agent.last_result;
+    }
 
-        return result;
+    /// Starts publishing the blackboard of the agent after each of its ticks, so
+    /// that other threads can read it through the returned handle while the agents
+    /// are ticked. `capacity` is the size of the buffer in bytes; a blackboard that
+    /// outgrows it is not published until it fits again.
+    ///
+    /// Only reading the handle is thread-safe. `observe()` itself changes the agent,
+    /// so call it from the thread that ticks the executor, between ticks, as with
+    /// `spawn()`.
+    std::shared_ptr<const SeqlockBlackboard> observe(size_t index, size_t capacity = 4096) {
+        auto& agent = agents[index];
+        if (!agent.observer) {
+            agent.observer = std::make_shared<SeqlockBlackboard>(capacity);
+            agent.observer->publish(agent.context.blackboard);
+        }
+        return agent.observer;
     }
-};
 
-class RepeatNode : public BehaviorNode {
-    int n = 0;
-    BehaviorResult tick(Context& ctx) override {
-        BehaviorResult result = BehaviorResult::Fail;
-        auto n = ctx.get("n");
-        if (!n) throw invalid_count_error();
-        if (this->n == 0) this->n = std::atoi(n->c_str());
-        if (!this->n) {
-            throw invalid_count_error();
+    /// Adds the queued agents that can be completed within the budget and evaluates
+    /// the batched conditions. `tick()` calls it before ticking the agents.
+    void begin_frame() {
+        build_spawns();
+        if (batch_enabled) {
+            batch_conditions.evaluate(column_blackboard);
         }
-        this->n--;
-        if (this->n == 0) {
-            return BehaviorResult::Success;
+    }
+
+    /// Adds the queued agents that can be completed within the budget, and ticks
+    /// all the agents once.
+    void tick() {
+        begin_frame();
+        for (size_t i = 0; i < agents.size(); i++) {
+            tick_agent(i);
         }
-        auto res = ctx.tick_child(0);
-        if (!res) return BehaviorResult::Fail;
-        if (res == BehaviorResult::Success) {
-            return BehaviorResult::Running;
+    }
+
+    /// Writes the state of all the agents as lines of tab separated fields:
+    /// `column <name> <value per agent>...` for each column, then for each agent
+    /// `agent <index> <last result>`, `var <name> <value>` for each variable of its
+    /// blackboard in name order, and the `node` lines of its tree.
+    void write_snapshot(std::ostream& os) const {
+        os.precision(17);
+        for (auto& name : column_blackboard.names()) {
+            os << "column\t" << escape_snapshot_field(name);
+            auto values = column_blackboard.find(name);
+            for (size_t i = 0; i < column_blackboard.size(); i++) {
+                os << "\t" << values[i];
+            }
+            os << "\n";
         }
-        else if (res == BehaviorResult::Running) {
-            return BehaviorResult::Running;
+        for (size_t i = 0; i < agents.size(); i++) {
+            auto& agent = agents[i];
+            os << "agent\t" << i << "\t" << to_string(agent.last_result) << "\n";
+            std::vector<std::pair<std::string, std::string>> vars(
+                agent.context.blackboard.begin(), agent.context.blackboard.end());
+            std::sort(vars.begin(), vars.end());
+            for (auto& [name, value] : vars) {
+                os << "var\t" << escape_snapshot_field(name) << "\t" << escape_snapshot_field(value) << "\n";
+            }
+            behavior_tree_lite::write_snapshot(os, agent.tree);
         }
-        this->n = 0;
-        return *res;
     }
-};
 
-class RetryNode : public BehaviorNode {
-    int n = 0;
-    BehaviorResult tick(Context& ctx) override {
-        BehaviorResult result = BehaviorResult::Fail;
-        auto n = ctx.get("n");
-        if (!n) throw invalid_count_error();
-        if (this->n == 0) this->n = std::atoi(n->c_str());
-        if (!this->n) {
-            throw invalid_count_error();
+    /// Writes the columns and the agents, each with its last result, its blackboard
+    /// and its tree as it is now, as a JSON object. See `write_snapshot()` for a
+    /// format to take a snapshot in the background.
+    void write_json(JsonWriter& json) const {
+        json.begin_object();
+        json.key("columns").begin_object();
+        for (auto& name : column_blackboard.names()) {
+            json.key(name).begin_array();
+            auto values = column_blackboard.find(name);
+            for (size_t i = 0; i < column_blackboard.size(); i++) {
+                json.value(values[i]);
+            }
+            json.end_array();
         }
-        this->n--;
-        if (this->n == 0) {
-            return BehaviorResult::Success;
+        json.end_object();
+        json.key("agents").begin_array();
+        for (auto& agent : agents) {
+            json.begin_object();
+            json.key("last_result").value(to_string(agent.last_result));
+            json.key("blackboard");
+            behavior_tree_lite::write_json(json, agent.context.blackboard);
+            json.key("tree");
+            behavior_tree_lite::write_json(json, agent.tree);
+            json.end_object();
         }
-        auto res = ctx.tick_child(0);
-        if (!res) return BehaviorResult::Fail;
-        if (res == BehaviorResult::Fail) {
-            return BehaviorResult::Running;
+        json.end_array();
+        json.end_object();
+    }
+
+    struct Snapshot {
+        /// How long the ticking was stopped to take the snapshot
+        std::chrono::nanoseconds pause;
+        /// Becomes true when the file is written, or false if writing failed
+        std::future<bool> written;
+    };
+
+    /// Takes a snapshot of the state of all the agents between ticks and writes it
+    /// to the file in the format of `write_snapshot()` in the background. On POSIX
+    /// systems the process is forked, so the pause is the time of `fork()` and the
+    /// agents can be ticked right away while the child process writes the pages it
+    /// shares copy-on-write. Elsewhere the snapshot is serialized into memory first.
+    /// Dropping the returned `written` future does not wait for the writing.
+    ///
+    /// The forked child has only the calling thread, and it allocates and uses
+    /// streams to write. Do not take a snapshot while other threads may hold a lock
+    /// it needs, such as the threads of a `NumaExecutor` ticking or a `TreeLibrary`
+    /// compiling, or the child can deadlock and `written` never becomes ready.
+    [[nodiscard]] Snapshot snapshot(std::filesystem::path path) const {
+        auto start = std::chrono::steady_clock::now();
+#if BEHAVIOR_TREE_LITE_POSIX
+        std::cout.flush();
+        std::cerr.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            bool ok = false;
+            try {
+                std::ofstream os(path);
+                write_snapshot(os);
+                os.flush();
+                ok = os.good();
+            }
+            catch (...) {}
+            _exit(ok ? 0 : 1);
         }
-        else if (res == BehaviorResult::Running) {
-            return BehaviorResult::Running;
+        auto pause = std::chrono::steady_clock::now() - start;
+        if (pid < 0) {
+            std::promise<bool> failed;
+            failed.set_value(false);
+            return Snapshot{ pause, failed.get_future() };
         }
-        this->n = 0;
-        return *res;
+        // Reap the child on a detached thread rather than with std::async, whose
+        // future would block in its destructor until the child exits.
+        std::promise<bool> exited;
+        auto written = exited.get_future();
+        std::thread([pid, exited = std::move(exited)]() mutable {
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0) {
+                if (errno != EINTR) {
+                    exited.set_value(false);
+                    return;
+                }
+            }
+            exited.set_value(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }).detach();
+        return Snapshot{ pause, std::move(written) };
+#else
+        auto buffer = std::make_shared<std::ostringstream>();
+        write_snapshot(*buffer);
+        auto pause = std::chrono::steady_clock::now() - start;
+        std::promise<bool> done;
+        auto written = done.get_future();
+        std::thread([buffer, path, done = std::move(done)]() mutable {
+            std::ofstream os(path);
+            os << buffer->str();
+            done.set_value(os.good());
+        }).detach();
+        return Snapshot{ pause, std::move(written) };
+#endif
     }
 };
 
-class TrueNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        return BehaviorResult::Success;
+
+/// Ticks a candidate program in the shadow of the agents of an `Executor`, to
+/// compare its cost and its decisions with the live trees before rolling it out.
+///
+/// A sample of the agents gets an instance of the candidate. Before each live tick
+/// of a sampled agent, its blackboard and its row of the columns are forked into
+/// the shadow context, and the shadow is ticked right before the live tree, so the
+/// candidate decides on the same inputs. The shadow context has no columns, and
+/// with `Context::shadow` set, writes to bound fields go to copies of the fields
+/// that last until the next fork, so the candidate does not affect the live agents.
+/// The user data is otherwise shared with the live agent, so nodes that change it
+/// directly must check `Context::shadow`, as `Registry` notes.
+class ShadowExecutor {
+public:
+    struct Report {
+        /// The number of sampled agents and their ticks
+        size_t agents = 0;
+        size_t ticks = 0;
+        /// The ticks where the candidate returned a different result
+        size_t divergent_ticks = 0;
+        /// The sampled agents that diverged at least once
+        size_t divergent_agents = 0;
+        std::chrono::nanoseconds live_time{0};
+        std::chrono::nanoseconds shadow_time{0};
+        /// The number of ticks by the live result and the candidate result
+        size_t results[3][3] = {};
+    };
+
+private:
+    struct Shadow {
+        size_t index;
+        BehaviorNodeContainer tree;
+        Context context;
+        size_t ticks = 0;
+        size_t divergent_ticks = 0;
+        std::chrono::nanoseconds live_time{0};
+        std::chrono::nanoseconds shadow_time{0};
+        size_t results[3][3] = {};
+    };
+
+    Executor& live;
+    std::shared_ptr<const Program> candidate;
+    uint64_t threshold;
+    uint64_t seed;
+    std::vector<Shadow> shadows;
+    /// The agents checked for sampling so far
+    size_t checked = 0;
+
+    bool sampled(size_t index) const {
+        // splitmix64 of the index, so that the sample does not follow the spawn order
+        uint64_t h = index + seed + 0x9E3779B97F4A7C15ull;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        h ^= h >> 31;
+        return h <= threshold;
     }
-};
 
-class FalseNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        return BehaviorResult::Fail;
+    void fork(Shadow& shadow) {
+        auto& agent = live.agent(shadow.index);
+        shadow.context.blackboard = agent.context.blackboard;
+        auto& columns = live.columns();
+        if (shadow.index < columns.size()) {
+            for (auto& name : columns.names()) {
+                shadow.context.blackboard[name] = format_number(columns.find(name)[shadow.index]);
+            }
+        }
+        shadow.context.user_data = agent.context.user_data;
+        shadow.context.user_type = agent.context.user_type;
+        shadow.context.shadow_fields.clear();
     }
-};
 
-class SetBoolNode : public BehaviorNode {
-    BehaviorResult tick(Context& context) override {
-        auto var_it = context.get("value");
-        if (var_it) {
-            context.set("output", *var_it);
+public:
+    /// Shadows about `sample_rate` of the agents, chosen by their indices and the seed.
+    ShadowExecutor(Executor& live, std::shared_ptr<const Program> candidate, double sample_rate = 0.01, uint64_t seed = 0) :
+        live(live),
+        candidate(std::move(candidate)),
+        threshold(sample_rate >= 1. ? std::numeric_limits<uint64_t>::max()
+            : static_cast<uint64_t>(std::max(0., sample_rate) * 18446744073709551616.)),
+        seed(seed) {}
+
+    /// Ticks all the live agents once like `Executor::tick()`, and the shadows of the
+    /// sampled ones.
+    void tick() {
+        live.begin_frame();
+        for (; checked < live.size(); checked++) {
+            if (!sampled(checked)) continue;
+            Shadow shadow{ checked, instantiate(*candidate), {} };
+            shadow.context.shadow = true;
+            shadows.push_back(std::move(shadow));
+        }
+        auto next = shadows.begin();
+        for (size_t i = 0; i < live.size(); i++) {
+            if (next == shadows.end() || next->index != i) {
+                live.tick_agent(i);
+                continue;
+            }
+            auto& shadow = *next++;
+            fork(shadow);
+            auto start = std::chrono::steady_clock::now();
+            shadow.context.generation = new_generation();
+            auto shadow_result = shadow.tree.tick(shadow.context);
+            auto middle = std::chrono::steady_clock::now();
+            auto live_result = live.tick_agent(i);
+            auto end = std::chrono::steady_clock::now();
+            shadow.shadow_time += middle - start;
+            shadow.live_time += end - middle;
+            shadow.ticks++;
+            shadow.results[static_cast<int>(live_result)][static_cast<int>(shadow_result)]++;
+            if (live_result != shadow_result) shadow.divergent_ticks++;
         }
+    }
 
-        return BehaviorResult::Success;
+    /// The indices of the sampled agents
+    std::vector<size_t> sample() const {
+        std::vector<size_t> ret;
+        for (auto& shadow : shadows) {
+            ret.push_back(shadow.index);
+        }
+        return ret;
     }
-};
 
-class IfNode : public BehaviorNode {
-    std::optional<BehaviorResult> condition_result;
-    BehaviorResult tick(Context& ctx) override {
-        auto res = ctx.tick_child(0);
-        if (res == BehaviorResult::Fail) {
-            auto res2 = ctx.tick_child(2);
-            if (res2) return *res2;
-            return BehaviorResult::Fail;
+    Report report() const {
+        Report ret;
+        for (auto& shadow : shadows) {
+            ret.agents++;
+            ret.ticks += shadow.ticks;
+            ret.divergent_ticks += shadow.divergent_ticks;
+            if (shadow.divergent_ticks) ret.divergent_agents++;
+            ret.live_time += shadow.live_time;
+            ret.shadow_time += shadow.shadow_time;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    ret.results[i][j] += shadow.results[i][j];
+                }
+            }
         }
-        auto res2 = ctx.tick_child(1);
-        if (res2) return *res2;
-        return BehaviorResult::Fail;
+        return ret;
     }
 };
 
-struct PortSpec {
-    PortType ty;
-    std::string key;
-
-    static PortSpec new_in(const std::string& key) {
-        return PortSpec {
-            .ty = PortType::Input,
-            .key = key,
-        };
+inline std::ostream &operator<<(std::ostream& os, const ShadowExecutor::Report& report) {
+    auto per_tick = [&](std::chrono::nanoseconds time) {
+        return report.ticks ? static_cast<double>(time.count()) / report.ticks : 0.;
+    };
+    os << "agents: " << report.agents << ", ticks: " << report.ticks << "\n";
+    os << "live: " << per_tick(report.live_time) << " ns/tick, candidate: "
+        << per_tick(report.shadow_time) << " ns/tick";
+    if (report.live_time.count()) {
+        os << " (" << 100. * report.shadow_time.count() / report.live_time.count() << "%)";
     }
-
-    static PortSpec new_out(const std::string& key) {
-        return PortSpec {
-            .ty = PortType::Output,
-            .key = key,
-        };
+    os << "\n";
+    os << "divergent ticks: " << report.divergent_ticks << ", divergent agents: "
+        << report.divergent_agents << "\n";
+    os << "live \\ candidate\tSuccess\tFail\tRunning\n";
+    for (int i = 0; i < 3; i++) {
+        os << to_string(static_cast<BehaviorResult>(i));
+        for (int j = 0; j < 3; j++) {
+            os << "\t" << report.results[i][j];
+        }
+        os << "\n";
     }
+    return os;
+}
 
-    static PortSpec new_inout(const std::string& key) {
-        return PortSpec {
-            .ty = PortType::InOut,
-            .key = key,
-        };
-    }
+/// A NUMA node of the machine and its CPUs
+struct NumaNode {
+    int id = 0;
+    std::vector<int> cpus;
 };
 
+/// Parses a list of CPUs in the format of the kernel, such as "0-3,8,10-11".
+inline std::vector<int> parse_cpu_list(std::string_view s) {
+    std::vector<int> ret;
+    while (!s.empty()) {
+        auto comma = s.find(',');
+        auto range = s.substr(0, comma);
+        s = comma == std::string_view::npos ? std::string_view() : s.substr(comma + 1);
+        while (!range.empty() && std::isspace(static_cast<unsigned char>(range.back()))) {
+            range.remove_suffix(1);
+        }
+        if (range.empty()) continue;
+        auto dash = range.find('-');
+        auto first = std::atoi(std::string(range.substr(0, dash)).c_str());
+        auto last = dash == std::string_view::npos ? first : std::atoi(std::string(range.substr(dash + 1)).c_str());
+        for (int cpu = first; cpu <= last; cpu++) {
+            ret.push_back(cpu);
+        }
+    }
+    return ret;
+}
 
-/// SubtreeNode is a container for a subtree, introducing a local namescope of blackboard variables.
-struct SubtreeNode : public BehaviorNode {
-    /// Blackboard variables needs to be a part of the node payload
-    Blackboard blackboard;
-    std::vector<PortSpec> params;
+/// Returns the NUMA nodes of the machine from /sys/devices/system/node, or a single
+/// node without CPUs, which means any CPU, if the machine does not tell.
+inline std::vector<NumaNode> numa_nodes() {
+    std::vector<NumaNode> ret;
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        auto name = entry.path().filename().string();
+        if (name.rfind("node", 0) != 0 || name.size() == 4
+            || !std::all_of(name.begin() + 4, name.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); }))
+        {
+            continue;
+        }
+        std::ifstream file(entry.path() / "cpulist");
+        std::string list;
+        std::getline(file, list);
+        auto cpus = parse_cpu_list(list);
+        if (cpus.empty()) continue;
+        ret.push_back(NumaNode{ std::atoi(name.c_str() + 4), std::move(cpus) });
+    }
+    std::sort(ret.begin(), ret.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+    if (ret.empty()) {
+        ret.push_back(NumaNode{});
+    }
+    return ret;
+}
 
-    SubtreeNode(Blackboard blackboard, std::vector<PortSpec> params) :
-        blackboard(std::move(blackboard)), params(std::move(params)) {
+/// Restricts the calling thread to the CPUs. Returns false if it is not supported.
+inline bool pin_thread(const std::vector<int>& cpus) {
+#ifdef __linux__
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+        if (0 <= cpu && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
     }
+    return sched_setaffinity(0, sizeof set, &set) == 0;
+#else
+    return false;
+#endif
+}
 
-    BehaviorResult tick(Context& ctx) override {
-        BehaviorResult res = BehaviorResult::Success;
-        for (auto& param : params) {
-            if (param.ty != PortType::Input && param.ty != PortType::InOut) {
-                continue;
-            }
-            if (auto value = ctx.get(param.key)) {
-                blackboard[param.key] = *value;
+/// Ticks agents in shards, each an `Executor` with a thread of its own.
+///
+/// With placement, the shards are distributed over the NUMA nodes, their threads
+/// are pinned to the CPUs of their nodes, and the agents are instantiated and their
+/// blackboards copied by the threads of their shards. The memory of an agent is then
+/// allocated from the malloc arena of the thread, in pages the kernel places on the
+/// node that touches them first, so the agents are ticked from local memory.
+/// Without placement, the threads float and the agents are instantiated by the
+/// caller, like agents loaded on one thread and ticked by others.
+///
+/// A machine without NUMA information is treated as a single node.
+class NumaExecutor {
+    struct Shard {
+        NumaNode node;
+        Executor executor;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::packaged_task<void()>> jobs;
+        bool stop = false;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    bool placement;
+    size_t next_shard = 0;
+
+    static void work(Shard& shard, bool pin) {
+        if (pin) {
+            pin_thread(shard.node.cpus);
+        }
+        while (true) {
+            std::packaged_task<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                shard.cv.wait(lock, [&]() { return shard.stop || !shard.jobs.empty(); });
+                if (shard.jobs.empty()) return;
+                job = std::move(shard.jobs.front());
+                shard.jobs.pop_front();
             }
+            job();
         }
+    }
 
-        std::swap(blackboard, ctx.blackboard);
-        auto sub_res = ctx.tick_child(0);
-        if (sub_res) res = *sub_res;
-        std::swap(blackboard, ctx.blackboard);
+public:
+    struct AgentId {
+        size_t shard;
+        /// The index of the agent in the `Executor` of the shard
+        size_t index;
+    };
 
-        // It is debatable if we should assign the output value back to the parent blackboard
-        // when the result was Fail or Running. We chose to assign them, which seems less counterintuitive.
-        for (auto& param : params) {
-            if (param.ty != PortType::Output || param.ty != PortType::InOut) {
-                continue;
-            }
-            auto value = blackboard.find(param.key);
-            if (value != blackboard.end()) {
-                ctx.set(param.key, value->second);
+    /// Makes `threads_per_node` shards on each NUMA node, or as many as the CPUs of
+    /// the node if it is 0.
+    explicit NumaExecutor(bool placement = true, size_t threads_per_node = 0) :
+        placement(placement)
+    {
+        for (auto& node : numa_nodes()) {
+            auto threads = threads_per_node ? threads_per_node : std::max<size_t>(1, node.cpus.size());
+            for (size_t i = 0; i < threads; i++) {
+                auto shard = std::make_unique<Shard>();
+                shard->node = node;
+                shards.push_back(std::move(shard));
             }
         }
-
-        return res;
+        for (auto& shard : shards) {
+            shard->thread = std::thread(work, std::ref(*shard), placement);
+        }
     }
-};
 
-Registry defaultRegistry() {
-    Registry registry;
+    NumaExecutor(const NumaExecutor&) = delete;
+    NumaExecutor& operator=(const NumaExecutor&) = delete;
 
-    registry.node_types.emplace(std::string("Sequence"),
-        std::function([](){ return std::make_unique<SequenceNode>(); }));
-    registry.node_types.emplace(std::string("ReactiveSequence"),
-        std::function([](){ return std::make_unique<ReactiveSequenceNode>(); }));
-    registry.node_types.emplace(std::string("Fallback"),
-        std::function([](){ return std::make_unique<FallbackNode>(); }));
-    registry.node_types.emplace(std::string("ReactiveFallbackStar"),
-        std::function([](){ return std::make_unique<ReactiveFallbackNode>(); }));
-    registry.node_types.emplace(std::string("ForceSuccess"),
-        std::function([](){ return std::make_unique<ForceSuccessNode>(); }));
-    registry.node_types.emplace(std::string("ForceFailure"),
-        std::function([](){ return std::make_unique<ForceFailureNode>(); }));
-    registry.node_types.emplace(std::string("Inverter"),
-        std::function([](){ return std::make_unique<InverterNode>(); }));
-    registry.node_types.emplace(std::string("Repeat"),
-        std::function([](){ return std::make_unique<RepeatNode>(); }));
-    registry.node_types.emplace(std::string("Retry"),
-        std::function([](){ return std::make_unique<RetryNode>(); }));
-    registry.node_types.emplace(std::string("true"),
-        std::function([](){ return std::make_unique<TrueNode>(); }));
-    registry.node_types.emplace(std::string("false"),
-        std::function([](){ return std::make_unique<FalseNode>(); }));
-    registry.node_types.emplace(std::string("SetBool"),
-        std::function([](){ return std::make_unique<SetBoolNode>(); }));
-    registry.node_types.emplace(std::string("if"),
-        std::function([](){ return std::make_unique<IfNode>(); }));
+    ~NumaExecutor() {
+        for (auto& shard : shards) {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->stop = true;
+            }
+            shard->cv.notify_one();
+        }
+        for (auto& shard : shards) {
+            shard->thread.join();
+        }
+    }
 
-    return registry;
-}
+    size_t shard_count() const {
+        return shards.size();
+    }
 
-BehaviorNodeContainer load_recurse(
-    const TreeDef& parent,
-    const TreeSource& tree_source,
-    const Registry& registry
-) {
-    std::vector<BehaviorNodeContainer> child_nodes;
+    /// The agents of a shard. Use it only between ticks, or in `run()` on the shard.
+    Executor& shard(size_t index) {
+        return shards[index]->executor;
+    }
 
-    std::unique_ptr<BehaviorNode> node;
-    auto tree_it = std::find_if(tree_source.begin(), tree_source.end(), [&parent](auto& tree) {
-        return tree.name == parent.name;
-    });
-    if (tree_it != tree_source.end()) {
-        std::vector<PortSpec> port_specs;
-        std::transform(tree_it->ports.begin(), tree_it->ports.end(), std::back_inserter(port_specs),
-            [](auto& port) {
-                return PortSpec {
-                    .ty = port.direction,
-                    .key = port.name,
-                };
-            });
-        node = std::make_unique<SubtreeNode>(Blackboard{}, port_specs);
-        child_nodes.push_back(load_recurse(tree_it->node, tree_source, registry));
+    const NumaNode& node_of(size_t shard) const {
+        return shards[shard]->node;
     }
-    else {
-        std::transform(parent.children.begin(), parent.children.end(), std::back_inserter(child_nodes),
-        [&tree_source, &registry](auto& child){
-            return load_recurse(child, tree_source, registry);
-        });
 
-        auto node_it = registry.node_types.find(parent.name);
-        if (node_it == registry.node_types.end()) {
-            throw undefined_node_error{parent.name};
+    /// Calls `f(Executor&)` on the thread of the shard, such as to ingest the values
+    /// of the columns of its agents into local memory.
+    template<typename F>
+    std::future<void> run(size_t shard, F f) {
+        auto& s = *shards[shard];
+        std::packaged_task<void()> job([&s, f = std::move(f)]() mutable { f(s.executor); });
+        auto ret = job.get_future();
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            s.jobs.push_back(std::move(job));
         }
-        node = node_it->second();
+        s.cv.notify_one();
+        return ret;
     }
 
-    BBMap bbmap;
-    for (auto& port_map : parent.port_maps) {
-        if (port_map.blackboard_literal) {
-            bbmap.emplace(port_map.node_port, port_map.value);
+    /// Spawns `count` agents of the program with copies of the blackboard, divided
+    /// evenly among the shards in contiguous blocks.
+    std::vector<AgentId> spawn(std::shared_ptr<const Program> program, size_t count, const Blackboard& blackboard = {}) {
+        std::vector<AgentId> ret(count);
+        std::vector<std::future<void>> done;
+        auto shared_blackboard = std::make_shared<const Blackboard>(blackboard);
+        size_t first = 0;
+        for (size_t s = 0; s < shards.size(); s++) {
+            auto n = count / shards.size() + (s < count % shards.size() ? 1 : 0);
+            if (!n) continue;
+            auto spawn_block = [=, &ret](Executor& executor) {
+                for (size_t i = 0; i < n; i++) {
+                    ret[first + i] = AgentId{ s, executor.spawn(instantiate(*program), *shared_blackboard) };
+                }
+            };
+            if (placement) {
+                done.push_back(run(s, spawn_block));
+            }
+            else {
+                spawn_block(shards[s]->executor);
+            }
+            first += n;
         }
-        else {
-            bbmap.emplace(port_map.node_port, std::make_pair(port_map.value, port_map.ty));
+        for (auto& f : done) {
+            f.get();
         }
+        return ret;
     }
 
-    return BehaviorNodeContainer(
-        parent.name,
-        std::move(node),
-        std::move(bbmap),
-        std::move(child_nodes)
-    );
-}
-
-/// Instantiate a behavior tree from a AST of a tree.
-///
-/// `check_ports` enables static checking of port availability before actually ticking.
-/// It is useful to catch errors in a behavior tree source file, but you need to
-/// implement [`crate::BehaviorNode::provided_ports`] to use it.
-std::optional<BehaviorNodeContainer> load(
-    TreeSource& tree_source,
-    const Registry& registry
-) {
-    auto main_it = std::find_if(tree_source.begin(), tree_source.end(), [](auto& tree) {
-        return tree.name == "main";
-    });
-
-    if (main_it == tree_source.end()) {
-        return std::nullopt;
+    /// Spawns an agent in the next shard in turn.
+    AgentId spawn(std::shared_ptr<const Program> program, Blackboard blackboard = {}) {
+        auto s = next_shard++ % shards.size();
+        if (!placement) {
+            return AgentId{ s, shards[s]->executor.spawn(instantiate(*program), std::move(blackboard)) };
+        }
+        size_t index = 0;
+        auto shared_blackboard = std::make_shared<const Blackboard>(std::move(blackboard));
+        run(s, [&](Executor& executor) {
+            index = executor.spawn(instantiate(*program), *shared_blackboard);
+        }).get();
+        return AgentId{ s, index };
     }
 
-    auto tree_con = load_recurse(main_it->node, tree_source, registry);
+    Executor::Agent& agent(AgentId id) {
+        return shards[id.shard]->executor.agent(id.index);
+    }
 
-    return tree_con;
-}
+    size_t size() const {
+        size_t ret = 0;
+        for (auto& shard : shards) {
+            ret += shard->executor.size();
+        }
+        return ret;
+    }
 
-BehaviorResult tick_node(BehaviorNodeContainer& node, Blackboard &bb) {
-    Context context { .blackboard = bb };
-    return node.tick(context);
-}
+    /// Ticks all the agents once, each shard on its thread, and waits for them.
+    void tick() {
+        std::vector<std::future<void>> done;
+        done.reserve(shards.size());
+        for (size_t s = 0; s < shards.size(); s++) {
+            done.push_back(run(s, [](Executor& executor) { executor.tick(); }));
+        }
+        for (auto& f : done) {
+            f.get();
+        }
+    }
+};
 
 }
 
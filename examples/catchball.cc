@@ -7,11 +7,21 @@
 
 using namespace behavior_tree_lite;
 
-// Note that the ball states are stored in global variables, which is not the best practice in production.
-// We do this here for brevity.
-// Consider putting them in a struct and exchange information to the behavior nodes by context variables.
-int ball_pos = 1;
-int ball_speed = 0;
+/// The state shared by the players.
+struct World {
+    int ball_pos = 1;
+    int ball_speed = 0;
+};
+
+/// The state of each player, given to the behavior nodes as the user data of the context.
+/// The `position` and `speed` variables are bound to its fields, so the nodes read them
+/// without going through the string blackboard.
+struct Player {
+    World* world;
+    int position;
+    int speed;
+};
+
 constexpr int A_pos = 1;
 constexpr int A_speed = 1;
 constexpr int B_pos = 15;
@@ -20,8 +30,11 @@ constexpr int B_speed = -1;
 /// Wait until a player receives a ball.
 class CatchBall : public BehaviorNode {
     BehaviorResult tick(Context& context) override {
-        auto position = std::atoi(context.get("position")->c_str());
-        if (ball_pos == position) {
+        auto player = context.user<Player>();
+        auto position = context.get_field<int>("position");
+        // The ports are not bound to the fields of a Player
+        if (!player || !position) return BehaviorResult::Fail;
+        if (player->world->ball_pos == *position) {
             return BehaviorResult::Success;
         }
         return BehaviorResult::Running;
@@ -31,21 +44,24 @@ class CatchBall : public BehaviorNode {
 /// Throws a ball from current position with the given speed.
 class ThrowBall : public BehaviorNode {
     BehaviorResult tick(Context& context) override {
-        auto position = std::atoi(context.get("position")->c_str());
-        if (ball_pos != position) {
+        auto player = context.user<Player>();
+        auto position = context.get_field<int>("position");
+        auto speed = context.get_field<int>("speed");
+        if (!player || !position || !speed) return BehaviorResult::Fail;
+        auto world = player->world;
+        if (world->ball_pos != *position) {
             // You cannot throw a ball that is not in your hands.
             return BehaviorResult::Fail;
         }
-        auto speed = std::atoi(context.get("speed")->c_str());
-        ball_speed = speed;
+        world->ball_speed = *speed;
         return BehaviorResult::Success;
     }
 };
 
-void print_ball() {
+void print_ball(const World& world) {
     std::cout << '|';
     for (size_t i = 0; i < 17; i++) {
-        if (ball_pos == i) std::cout << 'o';
+        if (world.ball_pos == i) std::cout << 'o';
         else if (A_pos == i) std::cout << 'A';
         else if (B_pos == i) std::cout << 'B';
         else std::cout << ' ';
@@ -73,24 +89,26 @@ void run() {
         std::function([](){ return std::make_unique<CatchBall>(); }));
     registry.node_types.emplace(std::string("ThrowBall"),
         std::function([](){ return std::make_unique<ThrowBall>(); }));
+    registry.bind_field("position", &Player::position);
+    registry.bind_field("speed", &Player::speed);
+
+    World world;
 
     auto player_A_tree = load(pair.second, registry);
-    Blackboard player_A_bb = Blackboard{};
-    player_A_bb["position"] = std::to_string(A_pos);
-    player_A_bb["speed"] = std::to_string(A_speed);
-    auto player_A_context = Context{ .blackboard = player_A_bb };
+    Player player_A { .world = &world, .position = A_pos, .speed = A_speed };
+    auto player_A_context = Context{};
+    player_A_context.set_user(&player_A);
 
     auto player_B_tree = load(pair.second, registry);
-    Blackboard player_B_bb = Blackboard{};
-    player_B_bb["position"] = std::to_string(B_pos);
-    player_B_bb["speed"] = std::to_string(B_speed);
-    auto player_B_context = Context{ .blackboard = player_B_bb };
+    Player player_B { .world = &world, .position = B_pos, .speed = B_speed };
+    auto player_B_context = Context{};
+    player_B_context.set_user(&player_B);
 
     BehaviorResult player_A_res = BehaviorResult::Success;
     BehaviorResult player_B_res = BehaviorResult::Success;
     do {
-        ball_pos += ball_speed;
-        print_ball();
+        world.ball_pos += world.ball_speed;
+        print_ball(world);
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
         player_A_res = player_A_tree->tick(player_A_context);
         player_B_res = player_B_tree->tick(player_B_context);
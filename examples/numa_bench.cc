@@ -0,0 +1,76 @@
+//! A benchmark of ticking many agents with and without NUMA-aware placement.
+//! With placement, each agent is instantiated and ticked by a thread pinned to
+//! the same NUMA node. Without it, the agents are instantiated by the main thread
+//! and ticked by threads anywhere, as with a plain `Executor` per thread.
+//!
+//!     ./numa_bench [agents] [frames]
+#include "../behavior_tree_lite.h"
+#include <chrono>
+
+using namespace behavior_tree_lite;
+
+/// Counts the ticks in the blackboard of the agent.
+class Count : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        auto count = context.get_number("input").value_or(0);
+        context.set("output", std::to_string(count + 1));
+        return BehaviorResult::Success;
+    }
+};
+
+double run(std::shared_ptr<const Program> program, bool placement, size_t agents, size_t frames) {
+    NumaExecutor executor(placement);
+    executor.spawn(program, agents, Blackboard{ {"hp", "100"}, {"armed", "1"}, {"count", "0"} });
+    executor.tick();
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < frames; i++) {
+        executor.tick();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count() / frames;
+}
+
+int main(int argc, char** argv) {
+    size_t agents = argc > 1 ? std::atoi(argv[1]) : 100000;
+    size_t frames = argc > 2 ? std::atoi(argv[2]) : 20;
+
+    std::string src = R"(tree main = Sequence {
+    Fallback {
+        Condition(expr <- "hp < 30")
+        Condition(expr <- "armed == 0")
+        Count(input <- count, output -> count)
+    }
+    ForceSuccess {
+        Inverter {
+            Condition(expr <- "hp > 200")
+        }
+    }
+}
+)";
+    auto res = source_text(src);
+    if (auto e = std::get_if<1>(&res)) {
+        std::cout << "Error: " << *e << "\n";
+        return 1;
+    }
+    auto tree_source = std::get<0>(res).second;
+
+    auto registry = defaultRegistry();
+    registry.node_types.emplace("Count", std::function([]() {
+        return std::unique_ptr<BehaviorNode>(new Count());
+    }));
+    auto program = tree_source.program("main", registry);
+
+    auto nodes = numa_nodes();
+    std::cout << nodes.size() << " NUMA node(s)";
+    for (auto& node : nodes) {
+        std::cout << ", node " << node.id << ": " << node.cpus.size() << " CPU(s)";
+    }
+    std::cout << "\n";
+
+    auto without = run(program, false, agents, frames);
+    std::cout << "without placement: " << without << " ms/frame\n";
+    auto with = run(program, true, agents, frames);
+    std::cout << "with placement:    " << with << " ms/frame\n";
+    return 0;
+}
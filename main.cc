@@ -1,6 +1,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <random>
 #include "behavior_tree_lite.h"
 
 using namespace behavior_tree_lite;
@@ -248,6 +249,38 @@ void test_retry_fail() {
     build_and_run(src);
 }
 
+/// A Sequence starts over after a child fails, and a Fallback resumes at its Running
+/// child. Each tick of `seq` should print "first" and fail, and `fallback` should
+/// count down 3, 2, 1 without printing "after CountDown".
+void test_sequence_fallback_resume() {
+    std::string src = R"(tree seq = Sequence {
+    Print(input <- "first")
+    false
+    Print(input <- "after false")
+}
+tree fallback = Fallback {
+    false
+    CountDown(count <- "3")
+    Print(input <- "after CountDown")
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Print"),
+        std::function([](){ return std::make_unique<PrintNode>(); }));
+    registry.node_types.emplace(std::string("CountDown"),
+        std::function([](){ return std::make_unique<CountDownNode>(); }));
+    for (auto entry : {"seq", "fallback"}) {
+        auto tree = load(tree_source, registry, entry);
+        Blackboard bb;
+        for (int i = 0; i < 3; i++) {
+            auto result = tick_node(*tree, bb);
+            std::cout << entry << " tick " << i << ": " << to_string(result) << "\n";
+        }
+    }
+}
+
 void test_conditional_true() {
     std::string src = R"(tree main = if (true) {
     Print(input <- "Got true")
@@ -320,6 +353,465 @@ void test_string_literal() {
     std::cout << "String literal: " << pair.second << ", remainder: \"" << pair.first << "\n";
 }
 
+void test_stream_parser() {
+    std::string src = R"(tree main = Sequence {
+    SubTree(param <- "Hello")
+}
+
+tree SubTree(in param) = Sequence {
+    Print(input <- param)
+}
+)";
+
+    StreamParser parser([](Tree tree) {
+        std::cout << "Tree streamed: " << tree.name << "\n";
+    });
+
+    // Feed a few bytes at a time to simulate a pipe
+    for (size_t i = 0; i < src.size(); i += 5) {
+        if (auto e = parser.feed(std::string_view(src).substr(i, 5))) {
+            std::cout << "Parse Error: " << *e << "\n";
+            return;
+        }
+    }
+    if (auto e = parser.finish()) {
+        std::cout << "Parse Error: " << *e << "\n";
+    }
+}
+
+void test_entry_point() {
+    std::string src = R"(tree main = Sequence {
+    Print(input <- "main")
+}
+
+tree other = Sequence {
+    Print(input <- "other")
+}
+)";
+
+    auto res = source_text(src);
+    if (auto e = std::get_if<1>(&res)) {
+        std::cout << "Parse Error: " << *e << "\n";
+        return;
+    }
+    auto source = std::get<0>(res).second;
+
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Print"),
+        std::function([](){ return std::make_unique<PrintNode>(); }));
+
+    // The second load reuses the program compiled by the first one
+    for (int i = 0; i < 2; i++) {
+        auto tree = load(source, registry, "other");
+        Blackboard bb;
+        tick_node(*tree, bb);
+    }
+}
+
+void test_decision_table() {
+    std::string src = R"(tree main = Sequence {
+    var armed = true
+    var hurt = false
+    table (armed, hurt) {
+        _, true => Print(input <- "Flee")
+        true, false => Print(input <- "Attack")
+        _, _ => Print(input <- "Wander")
+    }
+}
+)";
+
+    build_and_run(src);
+}
+
+/// A pure condition that prints when it is ticked, to see which ticks are shared.
+class ProbeNode : public BehaviorNode {
+    BehaviorResult tick(Context& context) override {
+        auto value = context.get_number("input");
+        std::cout << "Probe ticked\n";
+        return value && *value != 0. ? BehaviorResult::Success : BehaviorResult::Fail;
+    }
+};
+
+/// Identical pure conditions share their result within a tick until a node writes
+/// through `Context::set()`. It should print "Probe ticked" twice, for the first
+/// Probe and for the one after SetBool, and then "Success".
+void test_shared_conditions() {
+    std::string src = R"(tree main = Sequence {
+    Probe(input <- flag)
+    Probe(input <- flag)
+    SetBool(value <- "0", output -> flag)
+    Inverter {
+        Probe(input <- flag)
+    }
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Probe"),
+        std::function([](){ return std::make_unique<ProbeNode>(); }));
+    registry.pure_node_types.insert("Probe");
+    auto tree = load(tree_source, registry);
+    Blackboard bb;
+    bb["flag"] = "1";
+    std::cout << to_string(tick_node(*tree, bb)) << "\n";
+}
+
+/// Reports the writes to variables that nothing reads. It should report the write
+/// to `unused` only: `result` is an output of the tree, `shown` is printed and
+/// `logged` is declared external.
+void test_dead_stores() {
+    std::string src = R"(tree main(out result) = Sequence {
+    var unused
+    var shown
+    var logged
+    SetBool(value <- "1", output -> unused)
+    SetBool(value <- "1", output -> shown)
+    SetBool(value <- "1", output -> logged)
+    SetBool(value <- "1", output -> result)
+    Print(input <- shown)
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Print"),
+        std::function([](){ return std::make_unique<PrintNode>(); }));
+    registry.external_variables.insert("logged");
+    for (auto& store : find_dead_stores(tree_source, registry)) {
+        std::cout << store << "\n";
+    }
+
+    // The eliminated write leaves the variable unset
+    registry.eliminate_dead_stores = true;
+    auto tree = load(tree_source, registry);
+    Context context;
+    tree->tick(context);
+    std::cout << "unused: " << context.blackboard.count("unused")
+        << ", logged: " << context.blackboard.count("logged") << "\n";
+}
+
+/// Specializes the program on the spawn-constant `team`. Agents with the same team
+/// share a program until `max_specializations` teams are cached, and the other
+/// teams get the program without constants. It should print "red", "blue", "red"
+/// and "green", then "shared: 1, generic: 1" and the expression folded for team 1.
+void test_constant_specialization() {
+    std::string src = R"(tree main = Sequence {
+    if (Condition(expr <- "team == 1")) {
+        Print(input <- "red")
+    } else {
+        Print(input <- name)
+    }
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Print"),
+        std::function([](){ return std::make_unique<PrintNode>(); }));
+    registry.constant_variables.insert("team");
+    registry.max_specializations = 2;
+    for (auto [team, name] : {
+        std::make_pair("1", "red"),
+        std::make_pair("2", "blue"),
+        std::make_pair("1", "red"),
+        std::make_pair("3", "green"),
+    }) {
+        Blackboard bb;
+        bb["team"] = team;
+        bb["name"] = name;
+        auto tree = load(tree_source, registry, "main", bb);
+        tick_node(*tree, bb);
+    }
+    auto red = tree_source.program("main", registry, Blackboard{{"team", "1"}});
+    auto green = tree_source.program("main", registry, Blackboard{{"team", "3"}});
+    std::cout << "shared: " << (red == tree_source.program("main", registry, Blackboard{{"team", "1"}}))
+        << ", generic: " << (green == tree_source.program("main", registry)) << "\n";
+    for (auto& node : red->nodes) {
+        if (node.name == "Condition") std::cout << "folded: " << std::get<1>(node.blackboard_map.at("expr")) << "\n";
+    }
+}
+
+/// Spawns queued agents over several frames within a budget of 4 nodes per frame.
+/// Each agent's tree has 3 nodes, so it should add one agent in each of the first
+/// two frames and the last one in the third, and each agent prints its name twice
+/// per frame from the frame it is added.
+void test_spawn_queue() {
+    std::string src = R"(tree main = Sequence {
+    Print(input <- name)
+    Print(input <- name)
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Print"),
+        std::function([](){ return std::make_unique<PrintNode>(); }));
+    auto program = tree_source.program("main", registry);
+    Executor executor;
+    executor.set_spawn_budget(4);
+    for (auto name : {"a", "b", "c"}) {
+        executor.enqueue_spawn(program, Blackboard{{"name", name}}, [name](size_t index) {
+            std::cout << "spawned " << name << " at " << index << "\n";
+        });
+    }
+    for (int frame = 0; frame < 3; frame++) {
+        executor.tick();
+        std::cout << "frame " << frame << ": agents " << executor.size()
+            << ", pending " << executor.pending_spawns() << "\n";
+    }
+}
+
+/// Ticks a candidate tree in the shadow of live agents. The candidate disagrees
+/// with the live tree for x = 4 only, so it should report 1 divergent agent, and its
+/// writes should not reach the live blackboards.
+void test_shadow() {
+    std::string src = R"(tree main = Condition(expr <- "x < 5")
+tree candidate = Sequence {
+    SetBool(value <- "1", output -> touched)
+    Condition(expr <- "x < 3")
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    Executor executor;
+    for (auto x : {"1", "4", "7"}) {
+        executor.spawn(*load(tree_source, registry), Blackboard{{"x", x}});
+    }
+    ShadowExecutor shadow(executor, tree_source.program("candidate", registry), 1.);
+    for (int frame = 0; frame < 3; frame++) {
+        shadow.tick();
+    }
+    auto report = shadow.report();
+    std::cout << "shadowed agents: " << report.agents << ", divergent agents: " << report.divergent_agents
+        << ", divergent ticks: " << report.divergent_ticks
+        << ", touched: " << executor.agent(0).context.blackboard.count("touched") << "\n";
+}
+
+struct Agent {
+    int hp = 0;
+};
+
+/// A Condition reads a variable bound to a field like a port does. It should print
+/// "low hp" for hp 5 and "high hp" for hp 20.
+void test_condition_field() {
+    std::string src = R"(tree main = Fallback {
+    Sequence {
+        Condition(expr <- "hp < limit")
+        Print(input <- "low hp")
+    }
+    Print(input <- "high hp")
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Print"),
+        std::function([](){ return std::make_unique<PrintNode>(); }));
+    registry.bind_field("hp", &Agent::hp);
+    auto tree = load(tree_source, registry);
+    for (int hp : {5, 20}) {
+        Agent agent { .hp = hp };
+        Context context;
+        context.set_user(&agent);
+        context.blackboard["limit"] = "10";
+        tree->tick(context);
+    }
+}
+
+/// A UtilitySelector keeps its child until another one scores higher by more than the
+/// hysteresis, and leaves it when its score is missing or not a number. It should print
+/// "zero", "zero", "one", "zero", "one", "one".
+void test_utility_selector() {
+    std::string src = R"(tree main = UtilitySelector(score0 <- a, score1 <- b, hysteresis <- "0.5") {
+    Print(input <- "zero")
+    Print(input <- "one")
+}
+)";
+
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace(std::string("Print"),
+        std::function([](){ return std::make_unique<PrintNode>(); }));
+    auto tree = load(tree_source, registry);
+    Blackboard bb;
+    for (auto [a, b] : {
+        std::make_pair("1", "0"),
+        std::make_pair("1", "1.2"),
+        std::make_pair("1", "2"),
+        std::make_pair("3", "2"),
+        std::make_pair("", "1"),
+        std::make_pair("nan", "1"),
+    }) {
+        bb.erase("a");
+        if (*a) bb["a"] = a;
+        bb["b"] = b;
+        tick_node(*tree, bb);
+    }
+}
+
+/// Ticks its `id` with a result decided by the id, the tick count and the phase,
+/// and logs the ticks and halts, to compare two implementations of a tree.
+class LogNode : public BehaviorNode {
+    int ticks = 0;
+    BehaviorResult tick(Context& context) override {
+        auto id = *context.get("id");
+        uint64_t h = std::hash<std::string>()(id) ^ std::hash<std::string>()(context.blackboard["phase"])
+            ^ uint64_t(ticks++) * 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 31;
+        h *= 0x94D049BB133111EBull;
+        h ^= h >> 29;
+        auto result = static_cast<BehaviorResult>(h % 3);
+        context.blackboard["log"] += id + ":" + to_string(result) + " ";
+        return result;
+    }
+    void halt() override {
+        context_log += "halt ";
+        ticks = 0;
+    }
+public:
+    static inline std::string context_log;
+};
+
+std::string random_tree(std::mt19937& rng, int depth, int& next_id) {
+    auto leaf = [&]() { return "Log(id <- \"" + std::to_string(next_id++) + "\")"; };
+    auto children = [&](int min, int max) {
+        std::string ret;
+        int n = min + rng() % (max - min + 1);
+        for (int i = 0; i < n; i++) ret += random_tree(rng, depth + 1, next_id) + " ";
+        return ret;
+    };
+    static const char* expressions[] = {
+        "x < 3", "x >= 2 && !(y == 1)", "x < 3 && y != 0 || z", "!z", "x > -1.5 || y <= 0.25",
+    };
+    switch (rng() % (depth > 3 ? 2 : 11)) {
+        case 0: case 1: return leaf();
+        case 2: case 3: return "Sequence { " + children(0, 4) + "}";
+        case 4: case 5: return "Fallback { " + children(0, 4) + "}";
+        case 6: return "Inverter { " + children(1, 1) + "}";
+        case 7: return std::string(rng() % 2 ? "ForceSuccess" : "ForceFailure") + " { " + children(0, 1) + "}";
+        case 8: return "if (" + leaf() + ") { " + children(1, 2) + "}" + (rng() % 2 ? " else { " + children(1, 2) + "}" : "");
+        case 9: return "ReactiveSequence { " + children(1, 3) + "}";
+        default: return std::string("Condition(expr <- \"") + expressions[rng() % 5] + "\")";
+    }
+}
+
+/// Ticks an instance of the program with changing variables and a halt, and
+/// returns the results, the leaves ticked with their results and the halts.
+std::string run_logged(const Program& program) {
+    auto tree = instantiate(program);
+    // tick_node() would tick a copy of the blackboard and lose the log
+    Context context;
+    auto& bb = context.blackboard;
+    std::string log;
+    LogNode::context_log.clear();
+    for (int i = 0; i < 40; i++) {
+        bb["phase"] = std::to_string(i / 7);
+        bb["x"] = std::to_string(i % 5 - 1);
+        bb["y"] = std::to_string(i % 3);
+        bb["z"] = std::to_string(i % 2);
+        context.generation = new_generation();
+        log += to_string(tree.tick(context));
+        if (i == 25) tree.halt();
+    }
+    return log + bb["log"] + LogNode::context_log;
+}
+
+/// Compiles random trees with and without `Registry::compile_fsm` and checks that
+/// the state machines tick and halt the leaves as the interpreted trees do.
+void test_fsm() {
+    const int count = 3000;
+    std::mt19937 rng(2);
+    std::string src;
+    for (int t = 0; t < count; t++) {
+        int next_id = 0;
+        src += "tree main" + std::to_string(t) + " = " + random_tree(rng, 0, next_id) + "\n";
+    }
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace("Log", std::function([]() { return std::unique_ptr<BehaviorNode>(new LogNode()); }));
+    auto fsm_registry = registry;
+    fsm_registry.compile_fsm = true;
+    int mismatches = 0;
+    for (int t = 0; t < count; t++) {
+        auto entry = "main" + std::to_string(t);
+        auto interpreted = compile(tree_source, registry, entry);
+        auto fsm = compile(tree_source, fsm_registry, entry);
+        if (run_logged(*interpreted) != run_logged(*fsm)) mismatches++;
+    }
+    std::cout << "FSM trees: " << count << ", mismatches: " << mismatches << "\n";
+}
+
+/// Compiles random ReactiveFallbackStars over `if (var)` guards, which become
+/// `BitmaskFallbackNode`s unless a branch writes a guard, and checks that they tick
+/// and halt the leaves as the same factory registered under another name does.
+void test_bitmask_fallback() {
+    const int count = 1000;
+    std::mt19937 rng(3);
+    static const char* guards[] = { "x", "y", "z", "w" };
+    std::string src, interpreted_src;
+    for (int t = 0; t < count; t++) {
+        int next_id = 0;
+        std::string body;
+        int n = 1 + rng() % 5;
+        for (int i = 0; i < n; i++) {
+            // A write before a leaf that may fail changes the guards after the branch
+            body += std::string("if (") + guards[rng() % 4] + ") { ";
+            if (rng() % 4 == 0) body += std::string("SetBool(value <- \"") + (rng() % 2 ? "1" : "0") + "\", output -> w) ";
+            body += random_tree(rng, 2, next_id) + " } ";
+        }
+        auto header = "tree main" + std::to_string(t) + "(inout x, inout y, inout z, inout w) = ";
+        src += header + "ReactiveFallbackStar { " + body + "}\n";
+        interpreted_src += header + "InterpretedFallback { " + body + "}\n";
+    }
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto interpreted_source = std::get<0>(source_text(interpreted_src)).second;
+    auto registry = defaultRegistry();
+    registry.node_types.emplace("Log", std::function([]() { return std::unique_ptr<BehaviorNode>(new LogNode()); }));
+    registry.node_types.emplace("InterpretedFallback", registry.node_types.at("ReactiveFallbackStar"));
+    int compiled = 0;
+    int mismatches = 0;
+    for (int t = 0; t < count; t++) {
+        auto entry = "main" + std::to_string(t);
+        auto bitmask = compile(tree_source, registry, entry);
+        auto interpreted = compile(interpreted_source, registry, entry);
+        if (bitmask->nodes[bitmask->nodes[0].children[0]].name != "if") compiled++;
+        if (run_logged(*bitmask) != run_logged(*interpreted)) mismatches++;
+    }
+    std::cout << "Bitmask fallbacks: " << count << ", compiled: " << compiled << ", mismatches: " << mismatches << "\n";
+}
+
+/// Compiles random trees to native code and checks that they tick their leaves
+/// and return the same results as the interpreter. Run it from the repository
+/// root, where the generated code finds the header.
+void test_native() {
+    const int count = 100;
+    std::mt19937 rng(1);
+    std::string src;
+    for (int t = 0; t < count; t++) {
+        int next_id = 0;
+        src += "tree main" + std::to_string(t) + " = " + random_tree(rng, 0, next_id) + "\n";
+    }
+    auto tree_source = std::get<0>(source_text(src)).second;
+    auto registry = defaultRegistry();
+    registry.compile_fsm = true;
+    registry.node_types.emplace("Log", std::function([]() { return std::unique_ptr<BehaviorNode>(new LogNode()); }));
+    std::vector<std::shared_ptr<const Program>> programs;
+    for (int t = 0; t < count; t++) {
+        programs.push_back(compile(tree_source, registry, "main" + std::to_string(t)));
+    }
+    NativeOptions options;
+    options.header = "behavior_tree_lite.h";
+    auto library = NativeLibrary::compile(programs, options);
+    int mismatches = 0;
+    for (auto& program : programs) {
+        auto native = library->build(*program);
+        if (!native || run_logged(*program) != run_logged(*native)) mismatches++;
+    }
+    std::cout << "Native trees: " << count << ", mismatches: " << mismatches << "\n";
+}
+
 int main() {
     //test_tree();
     //test_fallback_tree();
@@ -335,10 +827,24 @@ int main() {
     //test_repeat_fail();
     //test_retry();
     //test_retry_fail();
+    //test_sequence_fallback_resume();
     //test_conditional_else_true();
     //test_conditional_else_false();
     test_var_decl();
     test_var_def();
+    //test_stream_parser();
+    //test_entry_point();
+    //test_decision_table();
+    //test_shared_conditions();
+    //test_dead_stores();
+    //test_constant_specialization();
+    //test_spawn_queue();
+    //test_shadow();
+    //test_condition_field();
+    //test_utility_selector();
+    //test_fsm();
+    //test_bitmask_fallback();
+    //test_native();
     return 0;
 }
 